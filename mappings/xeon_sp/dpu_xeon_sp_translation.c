@@ -7,13 +7,17 @@
 #else
 #include <asm/fpu/api.h>
 #endif
+#include <asm/cpufeature.h>
 #include <asm/io.h>
 #include <asm/special_insns.h>
 #include <linux/mm.h>
 #include <linux/delay.h>
+#include <linux/prefetch.h>
 #include <linux/irqflags.h>
 #include <linux/sizes.h>
 #include <linux/slab.h>
+#include <linux/topology.h>
+#include <linux/workqueue.h>
 
 #include "dpu_management.h"
 #include "dpu_power_management.h"
@@ -33,6 +37,230 @@ void byte_interleave(uint64_t *input, uint64_t *output)
 			((uint8_t *)&output[i])[j] = ((uint8_t *)&input[j])[i];
 }
 
+/*
+ * Vectorized variants of byte_interleave: the 64-byte block is seen as a
+ * 8x8 byte matrix (one row per uint64_t) that is transposed in registers.
+ * They all clobber vector registers and MUST be called between
+ * kernel_fpu_begin() and kernel_fpu_end().
+ */
+
+/* Interleaves the bytes of the two rows held by each 128-bit lane */
+static const uint8_t interleave_byte_shuffle[64] __aligned(64) = {
+	0, 8, 1, 9, 2, 10, 3, 11, 4, 12, 5, 13, 6, 14, 7, 15,
+	0, 8, 1, 9, 2, 10, 3, 11, 4, 12, 5, 13, 6, 14, 7, 15,
+	0, 8, 1, 9, 2, 10, 3, 11, 4, 12, 5, 13, 6, 14, 7, 15,
+	0, 8, 1, 9, 2, 10, 3, 11, 4, 12, 5, 13, 6, 14, 7, 15,
+};
+
+/* Interleaves the 16-bit words of both halves of each 128-bit lane */
+static const uint8_t interleave_word_shuffle[32] __aligned(32) = {
+	0, 1, 8, 9, 2, 3, 10, 11, 4, 5, 12, 13, 6, 7, 14, 15,
+	0, 1, 8, 9, 2, 3, 10, 11, 4, 5, 12, 13, 6, 7, 14, 15,
+};
+
+/* Gathers the 16-bit words of a same column from the 4 lanes */
+static const uint16_t interleave_word_permute[32] __aligned(64) = {
+	0, 8,  16, 24, 1, 9,  17, 25, 2, 10, 18, 26, 3, 11, 19, 27,
+	4, 12, 20, 28, 5, 13, 21, 29, 6, 14, 22, 30, 7, 15, 23, 31,
+};
+
+static void byte_interleave_sse2(uint64_t *input, uint64_t *output)
+{
+	asm volatile("movq 0x00(%0), %%xmm0\n\t"
+		     "movq 0x08(%0), %%xmm1\n\t"
+		     "movq 0x10(%0), %%xmm2\n\t"
+		     "movq 0x18(%0), %%xmm3\n\t"
+		     "movq 0x20(%0), %%xmm4\n\t"
+		     "movq 0x28(%0), %%xmm5\n\t"
+		     "movq 0x30(%0), %%xmm6\n\t"
+		     "movq 0x38(%0), %%xmm7\n\t"
+		     "punpcklbw %%xmm1, %%xmm0\n\t"
+		     "punpcklbw %%xmm3, %%xmm2\n\t"
+		     "punpcklbw %%xmm5, %%xmm4\n\t"
+		     "punpcklbw %%xmm7, %%xmm6\n\t"
+		     "movdqa %%xmm0, %%xmm1\n\t"
+		     "punpcklwd %%xmm2, %%xmm0\n\t"
+		     "punpckhwd %%xmm2, %%xmm1\n\t"
+		     "movdqa %%xmm4, %%xmm5\n\t"
+		     "punpcklwd %%xmm6, %%xmm4\n\t"
+		     "punpckhwd %%xmm6, %%xmm5\n\t"
+		     "movdqa %%xmm0, %%xmm2\n\t"
+		     "punpckldq %%xmm4, %%xmm0\n\t"
+		     "punpckhdq %%xmm4, %%xmm2\n\t"
+		     "movdqa %%xmm1, %%xmm3\n\t"
+		     "punpckldq %%xmm5, %%xmm1\n\t"
+		     "punpckhdq %%xmm5, %%xmm3\n\t"
+		     "movdqu %%xmm0, 0x00(%1)\n\t"
+		     "movdqu %%xmm2, 0x10(%1)\n\t"
+		     "movdqu %%xmm1, 0x20(%1)\n\t"
+		     "movdqu %%xmm3, 0x30(%1)"
+		     :
+		     : "r"(input), "r"(output)
+		     : "memory");
+}
+
+static void byte_interleave_avx2(uint64_t *input, uint64_t *output)
+{
+	asm volatile("vmovdqu 0x00(%0), %%ymm0\n\t"
+		     "vmovdqu 0x20(%0), %%ymm1\n\t"
+		     "vmovdqa %2, %%ymm2\n\t"
+		     "vmovdqa %3, %%ymm3\n\t"
+		     "vpshufb %%ymm2, %%ymm0, %%ymm0\n\t"
+		     "vpshufb %%ymm2, %%ymm1, %%ymm1\n\t"
+		     "vpermq $0xd8, %%ymm0, %%ymm0\n\t"
+		     "vpermq $0xd8, %%ymm1, %%ymm1\n\t"
+		     "vpshufb %%ymm3, %%ymm0, %%ymm0\n\t"
+		     "vpshufb %%ymm3, %%ymm1, %%ymm1\n\t"
+		     "vpunpckldq %%ymm1, %%ymm0, %%ymm2\n\t"
+		     "vpunpckhdq %%ymm1, %%ymm0, %%ymm3\n\t"
+		     "vperm2i128 $0x20, %%ymm3, %%ymm2, %%ymm0\n\t"
+		     "vperm2i128 $0x31, %%ymm3, %%ymm2, %%ymm1\n\t"
+		     "vmovdqu %%ymm0, 0x00(%1)\n\t"
+		     "vmovdqu %%ymm1, 0x20(%1)"
+		     :
+		     : "r"(input), "r"(output), "m"(interleave_byte_shuffle),
+		       "m"(interleave_word_shuffle)
+		     : "memory");
+}
+
+static void byte_interleave_avx512(uint64_t *input, uint64_t *output)
+{
+	asm volatile("vmovdqu64 (%0), %%zmm0\n\t"
+		     "vmovdqa64 %2, %%zmm1\n\t"
+		     "vmovdqa64 %3, %%zmm2\n\t"
+		     "vpshufb %%zmm1, %%zmm0, %%zmm0\n\t"
+		     "vpermw %%zmm0, %%zmm2, %%zmm0\n\t"
+		     "vmovdqu64 %%zmm0, (%1)"
+		     :
+		     : "r"(input), "r"(output), "m"(interleave_byte_shuffle),
+		       "m"(interleave_word_permute)
+		     : "memory");
+}
+
+static inline void write_line(uint8_t *dst, uint64_t *line)
+{
+	__raw_writeq(line[0], dst + 0 * sizeof(uint64_t));
+	__raw_writeq(line[1], dst + 1 * sizeof(uint64_t));
+	__raw_writeq(line[2], dst + 2 * sizeof(uint64_t));
+	__raw_writeq(line[3], dst + 3 * sizeof(uint64_t));
+	__raw_writeq(line[4], dst + 4 * sizeof(uint64_t));
+	__raw_writeq(line[5], dst + 5 * sizeof(uint64_t));
+	__raw_writeq(line[6], dst + 6 * sizeof(uint64_t));
+	__raw_writeq(line[7], dst + 7 * sizeof(uint64_t));
+}
+
+/*
+ * Stores a whole 64-byte line to the rank in a single non-temporal write:
+ * the line does not go through the cache, hence does not need to be
+ * flushed afterwards. Callers must be in a kernel_fpu_begin() section and
+ * issue a sfence once done.
+ */
+static void stream_line_sse2(void *dst, uint64_t *line)
+{
+	asm volatile("movdqu 0x00(%1), %%xmm0\n\t"
+		     "movdqu 0x10(%1), %%xmm1\n\t"
+		     "movdqu 0x20(%1), %%xmm2\n\t"
+		     "movdqu 0x30(%1), %%xmm3\n\t"
+		     "movntdq %%xmm0, 0x00(%0)\n\t"
+		     "movntdq %%xmm1, 0x10(%0)\n\t"
+		     "movntdq %%xmm2, 0x20(%0)\n\t"
+		     "movntdq %%xmm3, 0x30(%0)"
+		     :
+		     : "r"(dst), "r"(line)
+		     : "memory");
+}
+
+static void stream_line_avx512(void *dst, uint64_t *line)
+{
+	asm volatile("vmovdqu64 (%1), %%zmm0\n\t"
+		     "vmovntdq %%zmm0, (%0)"
+		     :
+		     : "r"(dst), "r"(line)
+		     : "memory");
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+static void stream_line_movdir64b(void *dst, uint64_t *line)
+{
+	movdir64b(dst, line);
+}
+#endif
+
+/* Selected once at module load by xeon_sp_translation_init */
+static void (*byte_interleave_fpu)(uint64_t *input,
+				   uint64_t *output) = byte_interleave_sse2;
+static void (*stream_line)(void *dst, uint64_t *line) = stream_line_sse2;
+
+/*
+ * Saving the FPU context is much more expensive than transposing one line,
+ * so it is done once per chunk of XFER_FPU_CHUNK_SIZE bytes of the MRAM
+ * range, i.e. for up to 8 DPU lines: this still bounds the time spent with
+ * preemption disabled on large transfers.
+ */
+#define XFER_FPU_CHUNK_SIZE SZ_2K
+
+/* Workers of parallel rank transfers, see xeon_sp_xfer_run */
+static struct workqueue_struct *xeon_sp_xfer_wq;
+
+void xeon_sp_translation_init(void)
+{
+	const char *name;
+
+#ifdef X86_FEATURE_AVX512BW
+	if (boot_cpu_has(X86_FEATURE_AVX512F) &&
+	    boot_cpu_has(X86_FEATURE_AVX512BW)) {
+		byte_interleave_fpu = byte_interleave_avx512;
+		name = "avx512bw";
+	} else
+#endif
+	if (boot_cpu_has(X86_FEATURE_AVX2)) {
+		byte_interleave_fpu = byte_interleave_avx2;
+		name = "avx2";
+	} else if (boot_cpu_has(X86_FEATURE_XMM2)) {
+		byte_interleave_fpu = byte_interleave_sse2;
+		name = "sse2";
+	} else {
+		byte_interleave_fpu = byte_interleave;
+		name = "scalar";
+	}
+
+	pr_info("dpu_region: xeon sp byte interleave uses %s\n", name);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+	if (boot_cpu_has(X86_FEATURE_MOVDIR64B)) {
+		stream_line = stream_line_movdir64b;
+		name = "movdir64b";
+	} else
+#endif
+	if (boot_cpu_has(X86_FEATURE_AVX512F)) {
+		stream_line = stream_line_avx512;
+		name = "avx512f";
+	} else if (boot_cpu_has(X86_FEATURE_XMM2)) {
+		stream_line = stream_line_sse2;
+		name = "sse2";
+	} else {
+		/* write_mode_store refuses the streaming mode then */
+		xeon_sp_translate.capabilities &= ~CAP_STREAM_WRITE;
+		name = NULL;
+	}
+
+	if (name)
+		pr_info("dpu_region: xeon sp streaming writes use %s\n", name);
+	else
+		pr_info("dpu_region: xeon sp streaming writes are not supported\n");
+
+	/* Transfers fall back to the caller CPU without it */
+	xeon_sp_xfer_wq = alloc_workqueue("dpu_xfer", WQ_HIGHPRI, 0);
+	if (!xeon_sp_xfer_wq)
+		pr_warn("dpu_region: cannot allocate transfer workqueue\n");
+}
+
+void xeon_sp_translation_exit(void)
+{
+	if (xeon_sp_xfer_wq)
+		destroy_workqueue(xeon_sp_xfer_wq);
+}
+
 void xeon_sp_write_to_cis(struct dpu_region_address_translation *tr,
 			  void *base_region_addr, uint8_t channel_id,
 			  void *block_data)
@@ -47,8 +275,10 @@ void xeon_sp_write_to_cis(struct dpu_region_address_translation *tr,
 
 	pr_debug("command: %16llx\n", ((uint64_t *)block_data)[0]);
 
+	kernel_fpu_begin();
+
 	/* 1/ Byte interleave the command */
-	byte_interleave(block_data, output);
+	byte_interleave_fpu(block_data, output);
 
 	/* 2/ Write the command */
 	/*
@@ -57,7 +287,6 @@ void xeon_sp_write_to_cis(struct dpu_region_address_translation *tr,
 	 * on the data bus in a single bus transaction.
 	 * cf. Intel Volume 3A: 11.3.1 Buffering of Write Combining Memory Locations
 	 */
-	kernel_fpu_begin();
 	asm volatile("vmovdqa64 %0, %%zmm0\n\t"
 		     "vmovntdq %%zmm0, %1"
 		     :
@@ -97,7 +326,9 @@ void xeon_sp_read_from_cis(struct dpu_region_address_translation *tr,
 		((volatile uint64_t *)input)[7] = __raw_readq(ci_address + 7);
 	}
 
-	/* 2/ Byte de-interleave the result */
+	/* 2/ Byte de-interleave the result: a single line does not pay for
+	 * saving the FPU context, keep the scalar version here.
+	 */
 	byte_interleave(input, block_data);
 
 	pr_debug("result:  %16llx\n", ((uint64_t *)block_data)[0]);
@@ -133,274 +364,400 @@ static u32 apply_address_translation_on_mram_offset(u32 byte_offset)
 	return unchanged_bits | (bits_21_to_15 << 14) | (bit_14 << 21);
 }
 
-void xeon_sp_write_to_rank(struct dpu_region_address_translation *tr,
-			   void *base_region_addr, uint8_t channel_id,
-			   struct dpu_transfer_mram *xfer_matrix)
+/* Offset in the rank mapping of the 64-bit word at byte_offset in MRAM */
+static uint64_t mram_offset_to_bank_offset(u32 byte_offset)
+{
+	uint32_t mram_64_bit_word_offset =
+		apply_address_translation_on_mram_offset(byte_offset) / 8;
+	uint64_t next_data =
+		BANK_OFFSET_NEXT_DATA(mram_64_bit_word_offset * sizeof(uint64_t));
+
+	return (next_data % BANK_CHUNK_SIZE) +
+	       (next_data / BANK_CHUNK_SIZE) * BANK_NEXT_CHUNK_OFFSET;
+}
+
+/*
+ * The address translation leaves bits [12:0] of the MRAM offset untouched,
+ * and BANK_CHUNK_SIZE covers exactly 8 KB of MRAM: within such a block,
+ * the bank offset of consecutive 64-bit words grows linearly. The iterator
+ * below only goes through the full translation when entering a new block.
+ */
+#define MRAM_LINEAR_BLOCK_SIZE (BANK_CHUNK_SIZE / BANK_OFFSET_NEXT_DATA(1))
+
+struct bank_offset_iter {
+	uint32_t mram_offset;
+	uint64_t offset;
+};
+
+static inline void bank_offset_iter_init(struct bank_offset_iter *iter,
+					 uint32_t mram_offset)
 {
-	uint8_t idx, ci_id, dpu_id, nb_cis, nb_dpus_per_ci;
+	iter->mram_offset = mram_offset;
+	iter->offset = mram_offset_to_bank_offset(mram_offset);
+}
 
-	nb_cis = tr->desc.topology.nr_of_control_interfaces;
-	nb_dpus_per_ci = tr->desc.topology.nr_of_dpus_per_control_interface;
+static inline void bank_offset_iter_next(struct bank_offset_iter *iter)
+{
+	iter->mram_offset += XFER_BLOCK_SIZE;
 
-	/* Works only for transfers of same size and same offset on the
-	 * same line
-	 */
-	for (dpu_id = 0, idx = 0; dpu_id < nb_dpus_per_ci;
-	     ++dpu_id, idx += nb_cis) {
-		uint8_t *ptr_dest =
-			(uint8_t *)base_region_addr + BANK_START(dpu_id);
-		uint32_t size_transfer = xfer_matrix->size;
-		uint32_t offset_in_mram = xfer_matrix->offset_in_mram;
-		uint64_t cache_line[8], cache_line_interleave[8];
-		uint32_t page[8];
-		uint32_t off_in_page[8];
-		uint32_t len_xfer_in_page[8];
-		uint32_t len_xfer_done_in_page[8];
-		struct xfer_page *xferp;
-		struct page *cur_page[8];
-		uint64_t len_xfer_done, len_xfer_remaining;
-		bool do_dpu_transfer = false;
-
-		for (ci_id = 0; ci_id < nb_cis; ++ci_id) {
-			xferp = xfer_matrix->ptr[idx + ci_id];
-			if (!xferp)
-				continue;
-
-			do_dpu_transfer = true;
-			page[ci_id] = 0;
-			cur_page[ci_id] = xferp->pages[0];
-			len_xfer_in_page[ci_id] =
-				min((uint32_t)PAGE_SIZE - xferp->off_first_page,
-				    (uint32_t)size_transfer);
-			off_in_page[ci_id] = xferp->off_first_page;
-			len_xfer_done_in_page[ci_id] = 0;
+	if (likely((iter->mram_offset % MRAM_LINEAR_BLOCK_SIZE) >=
+		   XFER_BLOCK_SIZE))
+		iter->offset += BANK_OFFSET_NEXT_DATA(XFER_BLOCK_SIZE);
+	else
+		iter->offset = mram_offset_to_bank_offset(iter->mram_offset);
+}
+
+/*
+ * A transfer moves the same MRAM range of every DPU line (dpu_id) of the
+ * rank. Consecutive lines live in different banks, so the transfer engine
+ * walks the MRAM range once and, for each 64-bit word, handles all the
+ * lines before moving to the next word: the memory controller then always
+ * has several banks in flight instead of a single stream.
+ */
+struct xeon_sp_xfer {
+	uint8_t *base;
+	struct dpu_transfer_mram *matrix;
+	uint8_t nb_cis;
+	uint8_t nb_dpus_per_ci;
+	/* Bitfield of the DPU lines that take part in the transfer */
+	uint8_t lines;
+	bool stream;
+};
+
+static void xeon_sp_xfer_init(struct xeon_sp_xfer *xfer,
+			      struct dpu_region_address_translation *tr,
+			      void *base_region_addr,
+			      struct dpu_transfer_mram *xfer_matrix)
+{
+	uint8_t idx, ci_id, dpu_id;
+
+	xfer->base = base_region_addr;
+	xfer->matrix = xfer_matrix;
+	xfer->nb_cis = tr->desc.topology.nr_of_control_interfaces;
+	xfer->nb_dpus_per_ci =
+		tr->desc.topology.nr_of_dpus_per_control_interface;
+	xfer->lines = 0;
+	xfer->stream = false;
+
+	for_each_dpu_in_rank(idx, ci_id, dpu_id, xfer->nb_cis,
+			     xfer->nb_dpus_per_ci)
+	{
+		if (xfer_matrix->ptr[idx])
+			xfer->lines |= 1 << dpu_id;
+	}
+}
+
+#define for_each_xfer_line(xfer, dpu_id)                                       \
+	for (dpu_id = 0; dpu_id < (xfer)->nb_dpus_per_ci; ++dpu_id)            \
+		if ((xfer)->lines & (1 << dpu_id))
+
+/* Kernel address of the 64-bit word at len_xfer_done in a host buffer */
+static inline uint64_t *xfer_word(struct xfer_page *xferp,
+				  uint64_t len_xfer_done)
+{
+	uint64_t pos = xferp->off_first_page + len_xfer_done;
+
+	return (uint64_t *)((uint8_t *)page_to_virt(
+				    xferp->pages[pos >> PAGE_SHIFT]) +
+			    (pos & ~PAGE_MASK));
+}
+
+/*
+ * The read path flushes the lines of the next window while loading the
+ * current one, so that invalidations and loads overlap: a window must be
+ * large enough to cover the latency of the fence separating them.
+ */
+#define XFER_READ_WINDOW_LINES 32
+#define XFER_READ_WINDOW_SIZE (XFER_READ_WINDOW_LINES * XFER_BLOCK_SIZE)
+
+/* Invalidates the lines of the next window, from the flush cursor */
+static inline void flush_read_window(struct xeon_sp_xfer *xfer,
+				     struct bank_offset_iter *iter,
+				     uint64_t *len_flushed, uint64_t end)
+{
+	uint8_t dpu_id;
+
+	end = min_t(uint64_t, *len_flushed + XFER_READ_WINDOW_SIZE, end);
+
+	for (; *len_flushed < end;
+	     *len_flushed += XFER_BLOCK_SIZE, bank_offset_iter_next(iter))
+		for_each_xfer_line(xfer, dpu_id)
+			clflushopt(xfer->base + BANK_START(dpu_id) +
+				   iter->offset);
+}
+
+/* Starts loading the lines of the window that has just been invalidated */
+static inline void prefetch_read_window(struct xeon_sp_xfer *xfer,
+					struct bank_offset_iter iter,
+					uint64_t len_xfer_done, uint64_t end)
+{
+	uint8_t dpu_id;
+
+	end = min_t(uint64_t, len_xfer_done + XFER_READ_WINDOW_SIZE, end);
+
+	for (; len_xfer_done < end;
+	     len_xfer_done += XFER_BLOCK_SIZE, bank_offset_iter_next(&iter))
+		for_each_xfer_line(xfer, dpu_id)
+			prefetch(xfer->base + BANK_START(dpu_id) +
+				 iter.offset);
+}
+
+/* Writes bytes [start, end[ of the transfer to all its DPU lines */
+static void xeon_sp_write_range(struct xeon_sp_xfer *xfer, uint64_t start,
+				uint64_t end)
+{
+	struct dpu_transfer_mram *xfer_matrix = xfer->matrix;
+	uint64_t cache_line[8];
+	uint64_t cache_line_interleave[8] __aligned(64);
+	struct bank_offset_iter iter;
+	uint64_t len_xfer_done;
+	uint8_t ci_id, dpu_id;
+
+	kernel_fpu_begin();
+
+	/* Split transfer into 8B blocks */
+	bank_offset_iter_init(&iter, xfer_matrix->offset_in_mram + start);
+	for (len_xfer_done = start; len_xfer_done < end;
+	     len_xfer_done += XFER_BLOCK_SIZE, bank_offset_iter_next(&iter)) {
+		if (len_xfer_done != start &&
+		    !((len_xfer_done - start) % XFER_FPU_CHUNK_SIZE)) {
+			kernel_fpu_end();
+			kernel_fpu_begin();
 		}
 
-		if (!do_dpu_transfer)
-			continue;
-
-		/* Split transfer into 8B blocks */
-		for (len_xfer_done = 0, len_xfer_remaining = size_transfer;
-		     len_xfer_done < size_transfer;
-		     len_xfer_done += XFER_BLOCK_SIZE) {
-			uint32_t mram_64_bit_word_offset =
-				apply_address_translation_on_mram_offset(
-					len_xfer_done + offset_in_mram) /
-				8;
-			uint64_t next_data = BANK_OFFSET_NEXT_DATA(
-				mram_64_bit_word_offset * sizeof(uint64_t));
-			uint64_t offset = (next_data % BANK_CHUNK_SIZE) +
-					  (next_data / BANK_CHUNK_SIZE) *
-						  BANK_NEXT_CHUNK_OFFSET;
-
-			for (ci_id = 0; ci_id < nb_cis; ++ci_id) {
-				if (xfer_matrix->ptr[idx + ci_id])
-					cache_line[ci_id] = *(
-						uint64_t
-							*)((uint8_t *)page_to_virt(
-								   cur_page[ci_id]) +
-							   off_in_page[ci_id] +
-							   len_xfer_done_in_page
-								   [ci_id]);
+		for_each_xfer_line(xfer, dpu_id) {
+			struct xfer_page **xferp =
+				(struct xfer_page **)&xfer_matrix
+					->ptr[dpu_id * xfer->nb_cis];
+			uint8_t *ptr_dest =
+				xfer->base + BANK_START(dpu_id) + iter.offset;
+
+			for (ci_id = 0; ci_id < xfer->nb_cis; ++ci_id) {
+				if (xferp[ci_id])
+					cache_line[ci_id] = *xfer_word(
+						xferp[ci_id], len_xfer_done);
 			}
 
-			byte_interleave(cache_line, cache_line_interleave);
-
-			__raw_writeq(cache_line_interleave[0],
-				     ptr_dest + offset + 0 * sizeof(uint64_t));
-			__raw_writeq(cache_line_interleave[1],
-				     ptr_dest + offset + 1 * sizeof(uint64_t));
-			__raw_writeq(cache_line_interleave[2],
-				     ptr_dest + offset + 2 * sizeof(uint64_t));
-			__raw_writeq(cache_line_interleave[3],
-				     ptr_dest + offset + 3 * sizeof(uint64_t));
-			__raw_writeq(cache_line_interleave[4],
-				     ptr_dest + offset + 4 * sizeof(uint64_t));
-			__raw_writeq(cache_line_interleave[5],
-				     ptr_dest + offset + 5 * sizeof(uint64_t));
-			__raw_writeq(cache_line_interleave[6],
-				     ptr_dest + offset + 6 * sizeof(uint64_t));
-			__raw_writeq(cache_line_interleave[7],
-				     ptr_dest + offset + 7 * sizeof(uint64_t));
-
-			len_xfer_remaining -= XFER_BLOCK_SIZE;
-
-			/* Check if we should switch to next page */
-			for (ci_id = 0; ci_id < nb_cis; ++ci_id) {
-				xferp = xfer_matrix->ptr[idx + ci_id];
-				if (!xferp)
-					continue;
-
-				len_xfer_done_in_page[ci_id] += XFER_BLOCK_SIZE;
-
-				if ((page[ci_id] < xferp->nb_pages - 1) &&
-				    (len_xfer_done_in_page[ci_id] >=
-				     len_xfer_in_page[ci_id])) {
-					page[ci_id]++;
-					cur_page[ci_id] =
-						xferp->pages[page[ci_id]];
-					len_xfer_in_page[ci_id] = min(
-						(uint32_t)PAGE_SIZE,
-						(uint32_t)len_xfer_remaining);
-					off_in_page[ci_id] = 0;
-					len_xfer_done_in_page[ci_id] = 0;
-				}
-			}
+			byte_interleave_fpu(cache_line, cache_line_interleave);
+
+			if (xfer->stream)
+				stream_line(ptr_dest, cache_line_interleave);
+			else
+				write_line(ptr_dest, cache_line_interleave);
 		}
+	}
 
-		mb();
+	kernel_fpu_end();
 
-		for (len_xfer_done = 0; len_xfer_done < size_transfer;
-		     len_xfer_done += XFER_BLOCK_SIZE) {
-			uint32_t mram_64_bit_word_offset =
-				apply_address_translation_on_mram_offset(
-					len_xfer_done + offset_in_mram) /
-				8;
-			uint64_t next_data = BANK_OFFSET_NEXT_DATA(
-				mram_64_bit_word_offset * sizeof(uint64_t));
-			uint64_t offset = (next_data % BANK_CHUNK_SIZE) +
-					  (next_data / BANK_CHUNK_SIZE) *
-						  BANK_NEXT_CHUNK_OFFSET;
-
-			clflushopt(ptr_dest + offset);
-		}
+	/* Streamed lines are already out of the cache, only wait for the
+	 * write-combining buffers to drain.
+	 */
+	if (xfer->stream) {
+		asm volatile("sfence" : : : "memory");
+		return;
+	}
 
-		mb();
+	mb();
+
+	bank_offset_iter_init(&iter, xfer_matrix->offset_in_mram + start);
+	for (len_xfer_done = start; len_xfer_done < end;
+	     len_xfer_done += XFER_BLOCK_SIZE, bank_offset_iter_next(&iter)) {
+		for_each_xfer_line(xfer, dpu_id)
+			clflushopt(xfer->base + BANK_START(dpu_id) +
+				   iter.offset);
 	}
+
+	mb();
 }
 
-void xeon_sp_read_from_rank(struct dpu_region_address_translation *tr,
-			    void *base_region_addr, uint8_t channel_id,
-			    struct dpu_transfer_mram *xfer_matrix)
+/* Reads bytes [start, end[ of the transfer from all its DPU lines */
+static void xeon_sp_read_range(struct xeon_sp_xfer *xfer, uint64_t start,
+			       uint64_t end)
 {
-	uint8_t idx, ci_id, dpu_id, nb_cis, nb_dpus_per_ci;
+	struct dpu_transfer_mram *xfer_matrix = xfer->matrix;
+	uint64_t cache_line[8], cache_line_interleave[8];
+	struct bank_offset_iter iter, flush_iter;
+	uint64_t len_xfer_done, len_flushed;
+	uint8_t ci_id, dpu_id;
 
-	nb_cis = tr->desc.topology.nr_of_control_interfaces;
-	nb_dpus_per_ci = tr->desc.topology.nr_of_dpus_per_control_interface;
+	mb();
 
-	/* Works only for transfers of same size and same offset on the
-	 * same line
+	/* Invalidate the first window, the next ones are invalidated while
+	 * the previous one is being loaded.
 	 */
-	for (dpu_id = 0, idx = 0; dpu_id < nb_dpus_per_ci;
-	     ++dpu_id, idx += nb_cis) {
-		uint8_t *ptr_dest =
-			(uint8_t *)base_region_addr + BANK_START(dpu_id);
-		uint32_t size_transfer = xfer_matrix->size;
-		uint32_t offset_in_mram = xfer_matrix->offset_in_mram;
-		uint64_t cache_line[8], cache_line_interleave[8];
-		uint32_t page[8];
-		uint32_t off_in_page[8];
-		uint32_t len_xfer_in_page[8];
-		uint32_t len_xfer_done_in_page[8];
-		struct xfer_page *xferp;
-		struct page *cur_page[8];
-		uint64_t len_xfer_done, len_xfer_remaining;
-		bool do_dpu_transfer = false;
-
-		for (ci_id = 0; ci_id < nb_cis; ++ci_id) {
-			xferp = xfer_matrix->ptr[idx + ci_id];
-			if (!xferp)
-				continue;
-
-			do_dpu_transfer = true;
-			page[ci_id] = 0;
-			cur_page[ci_id] = xferp->pages[0];
-			len_xfer_in_page[ci_id] =
-				min((uint32_t)PAGE_SIZE - xferp->off_first_page,
-				    (uint32_t)size_transfer);
-			off_in_page[ci_id] = xferp->off_first_page;
-			len_xfer_done_in_page[ci_id] = 0;
-		}
-
-		if (!do_dpu_transfer)
-			continue;
+	len_flushed = start;
+	bank_offset_iter_init(&flush_iter, xfer_matrix->offset_in_mram + start);
+	flush_read_window(xfer, &flush_iter, &len_flushed, end);
 
-		mb();
+	kernel_fpu_begin();
 
-		for (len_xfer_done = 0; len_xfer_done < size_transfer;
-		     len_xfer_done += XFER_BLOCK_SIZE) {
-			uint32_t mram_64_bit_word_offset =
-				apply_address_translation_on_mram_offset(
-					len_xfer_done + offset_in_mram) /
-				8;
-			uint64_t next_data = BANK_OFFSET_NEXT_DATA(
-				mram_64_bit_word_offset * sizeof(uint64_t));
-			uint64_t offset = (next_data % BANK_CHUNK_SIZE) +
-					  (next_data / BANK_CHUNK_SIZE) *
-						  BANK_NEXT_CHUNK_OFFSET;
-			clflushopt(ptr_dest + offset);
+	/* Split transfer into 8B blocks */
+	bank_offset_iter_init(&iter, xfer_matrix->offset_in_mram + start);
+	for (len_xfer_done = start; len_xfer_done < end;
+	     len_xfer_done += XFER_BLOCK_SIZE, bank_offset_iter_next(&iter)) {
+		if (len_xfer_done != start &&
+		    !((len_xfer_done - start) % XFER_FPU_CHUNK_SIZE)) {
+			kernel_fpu_end();
+			kernel_fpu_begin();
 		}
 
-		mb();
+		if (!((len_xfer_done - start) % XFER_READ_WINDOW_SIZE)) {
+			/* The current window is invalidated... */
+			mb();
+			prefetch_read_window(xfer, iter, len_xfer_done, end);
+			/* ...while the next one is being invalidated */
+			flush_read_window(xfer, &flush_iter, &len_flushed, end);
+		}
 
-		/* Split transfer into 8B blocks */
-		for (len_xfer_done = 0, len_xfer_remaining = size_transfer;
-		     len_xfer_done < size_transfer;
-		     len_xfer_done += XFER_BLOCK_SIZE) {
-			uint32_t mram_64_bit_word_offset =
-				apply_address_translation_on_mram_offset(
-					len_xfer_done + offset_in_mram) /
-				8;
-			uint64_t next_data = BANK_OFFSET_NEXT_DATA(
-				mram_64_bit_word_offset * sizeof(uint64_t));
-			uint64_t offset = (next_data % BANK_CHUNK_SIZE) +
-					  (next_data / BANK_CHUNK_SIZE) *
-						  BANK_NEXT_CHUNK_OFFSET;
-
-			cache_line[0] = __raw_readq(ptr_dest + offset +
-						    0 * sizeof(uint64_t));
-			cache_line[1] = __raw_readq(ptr_dest + offset +
-						    1 * sizeof(uint64_t));
-			cache_line[2] = __raw_readq(ptr_dest + offset +
-						    2 * sizeof(uint64_t));
-			cache_line[3] = __raw_readq(ptr_dest + offset +
-						    3 * sizeof(uint64_t));
-			cache_line[4] = __raw_readq(ptr_dest + offset +
-						    4 * sizeof(uint64_t));
-			cache_line[5] = __raw_readq(ptr_dest + offset +
-						    5 * sizeof(uint64_t));
-			cache_line[6] = __raw_readq(ptr_dest + offset +
-						    6 * sizeof(uint64_t));
-			cache_line[7] = __raw_readq(ptr_dest + offset +
-						    7 * sizeof(uint64_t));
-
-			byte_interleave(cache_line, cache_line_interleave);
-
-			for (ci_id = 0; ci_id < nb_cis; ++ci_id) {
-				if (xfer_matrix->ptr[idx + ci_id])
-					*(uint64_t *)((uint8_t *)page_to_virt(
-							      cur_page[ci_id]) +
-						      off_in_page[ci_id] +
-						      len_xfer_done_in_page
-							      [ci_id]) =
+		for_each_xfer_line(xfer, dpu_id) {
+			struct xfer_page **xferp =
+				(struct xfer_page **)&xfer_matrix
+					->ptr[dpu_id * xfer->nb_cis];
+			uint8_t *ptr_src =
+				xfer->base + BANK_START(dpu_id) + iter.offset;
+
+			cache_line[0] =
+				__raw_readq(ptr_src + 0 * sizeof(uint64_t));
+			cache_line[1] =
+				__raw_readq(ptr_src + 1 * sizeof(uint64_t));
+			cache_line[2] =
+				__raw_readq(ptr_src + 2 * sizeof(uint64_t));
+			cache_line[3] =
+				__raw_readq(ptr_src + 3 * sizeof(uint64_t));
+			cache_line[4] =
+				__raw_readq(ptr_src + 4 * sizeof(uint64_t));
+			cache_line[5] =
+				__raw_readq(ptr_src + 5 * sizeof(uint64_t));
+			cache_line[6] =
+				__raw_readq(ptr_src + 6 * sizeof(uint64_t));
+			cache_line[7] =
+				__raw_readq(ptr_src + 7 * sizeof(uint64_t));
+
+			byte_interleave_fpu(cache_line, cache_line_interleave);
+
+			for (ci_id = 0; ci_id < xfer->nb_cis; ++ci_id) {
+				if (xferp[ci_id])
+					*xfer_word(xferp[ci_id],
+						   len_xfer_done) =
 						cache_line_interleave[ci_id];
 			}
-
-			len_xfer_remaining -= XFER_BLOCK_SIZE;
-
-			/* Check if we should switch to next page */
-			for (ci_id = 0; ci_id < nb_cis; ++ci_id) {
-				xferp = xfer_matrix->ptr[idx + ci_id];
-				if (!xferp)
-					continue;
-
-				len_xfer_done_in_page[ci_id] += XFER_BLOCK_SIZE;
-
-				if ((page[ci_id] < xferp->nb_pages - 1) &&
-				    (len_xfer_done_in_page[ci_id] >=
-				     len_xfer_in_page[ci_id])) {
-					page[ci_id]++;
-					cur_page[ci_id] =
-						xferp->pages[page[ci_id]];
-					len_xfer_in_page[ci_id] = min(
-						(uint32_t)PAGE_SIZE,
-						(uint32_t)len_xfer_remaining);
-					off_in_page[ci_id] = 0;
-					len_xfer_done_in_page[ci_id] = 0;
-				}
-			}
 		}
 	}
+
+	kernel_fpu_end();
+}
+
+/*
+ * Large transfers can be split between kernel workers running on the CPUs
+ * of the rank NUMA node (see the xfer_workers rank attribute): each worker
+ * moves a contiguous part of the MRAM range of all the DPU lines while the
+ * caller waits for them.
+ */
+#define XFER_WORKER_MIN_SIZE SZ_64K
+
+struct xeon_sp_xfer_work {
+	struct work_struct work;
+	struct xeon_sp_xfer *xfer;
+	uint64_t start;
+	uint64_t end;
+	bool write;
+};
+
+static void xeon_sp_xfer_work_fn(struct work_struct *work)
+{
+	struct xeon_sp_xfer_work *xfer_work =
+		container_of(work, struct xeon_sp_xfer_work, work);
+
+	if (xfer_work->write)
+		xeon_sp_write_range(xfer_work->xfer, xfer_work->start,
+				    xfer_work->end);
+	else
+		xeon_sp_read_range(xfer_work->xfer, xfer_work->start,
+				   xfer_work->end);
+}
+
+/* Returns the next online CPU of node nid after cpu, wrapping around */
+static int xfer_next_node_cpu(int cpu, int nid)
+{
+	cpu = cpumask_next_and(cpu, cpumask_of_node(nid), cpu_online_mask);
+	if (cpu >= nr_cpu_ids)
+		cpu = cpumask_next_and(-1, cpumask_of_node(nid),
+				       cpu_online_mask);
+
+	return cpu;
+}
+
+static void xeon_sp_xfer_run(struct xeon_sp_xfer *xfer,
+			     struct dpu_rank_t *rank, bool write)
+{
+	struct xeon_sp_xfer_work works[DPU_RANK_MAX_XFER_WORKERS];
+	uint64_t size = xfer->matrix->size;
+	uint64_t chunk, start;
+	uint8_t nr_workers, i;
+	int cpu = -1;
+
+	nr_workers = min_t(uint64_t, READ_ONCE(rank->xfer_workers),
+			   size / XFER_WORKER_MIN_SIZE);
+
+	if (nr_workers && xeon_sp_xfer_wq && rank->nid != NUMA_NO_NODE)
+		cpu = xfer_next_node_cpu(-1, rank->nid);
+
+	/* Not worth it, or no CPU to run the workers on */
+	if (cpu < 0 || cpu >= nr_cpu_ids) {
+		if (write)
+			xeon_sp_write_range(xfer, 0, size);
+		else
+			xeon_sp_read_range(xfer, 0, size);
+		return;
+	}
+
+	chunk = round_up(DIV_ROUND_UP(size, nr_workers), XFER_BLOCK_SIZE);
+
+	for (i = 0, start = 0; i < nr_workers && start < size;
+	     ++i, start += chunk) {
+		INIT_WORK_ONSTACK(&works[i].work, xeon_sp_xfer_work_fn);
+		works[i].xfer = xfer;
+		works[i].start = start;
+		works[i].end = min_t(uint64_t, start + chunk, size);
+		works[i].write = write;
+
+		queue_work_on(cpu, xeon_sp_xfer_wq, &works[i].work);
+		cpu = xfer_next_node_cpu(cpu, rank->nid);
+	}
+
+	while (i--) {
+		flush_work(&works[i].work);
+		destroy_work_on_stack(&works[i].work);
+	}
+}
+
+/* Works only for transfers of same size and same offset on the same line */
+void xeon_sp_write_to_rank(struct dpu_region_address_translation *tr,
+			   void *base_region_addr, uint8_t channel_id,
+			   struct dpu_transfer_mram *xfer_matrix)
+{
+	struct dpu_region *region = (struct dpu_region *)tr->private;
+	struct xeon_sp_xfer xfer;
+
+	xeon_sp_xfer_init(&xfer, tr, base_region_addr, xfer_matrix);
+	xfer.stream = READ_ONCE(region->rank.write_mode) ==
+		      DPU_RANK_WRITE_MODE_STREAM;
+
+	if (xfer.lines)
+		xeon_sp_xfer_run(&xfer, &region->rank, true);
+}
+
+void xeon_sp_read_from_rank(struct dpu_region_address_translation *tr,
+			    void *base_region_addr, uint8_t channel_id,
+			    struct dpu_transfer_mram *xfer_matrix)
+{
+	struct dpu_region *region = (struct dpu_region *)tr->private;
+	struct xeon_sp_xfer xfer;
+
+	xeon_sp_xfer_init(&xfer, tr, base_region_addr, xfer_matrix);
+
+	if (xfer.lines)
+		xeon_sp_xfer_run(&xfer, &region->rank, false);
 }
 
 DEFINE_MUTEX(mutex_nb_ranks_allocated);
@@ -491,7 +848,7 @@ struct dpu_region_address_translation xeon_sp_translate = {
 		.dpu.nr_of_work_registers_per_thread = 24,
 	},
 	.backend_id = DPU_BACKEND_XEON_SP,
-	.capabilities = CAP_PERF | CAP_SAFE,
+	.capabilities = CAP_PERF | CAP_SAFE | CAP_STREAM_WRITE | CAP_PARALLEL_XFER,
 	.init_rank = xeon_sp_init_rank,
 	.destroy_rank = xeon_sp_destroy_rank,
 	.write_to_rank = xeon_sp_write_to_rank,
@@ -13,30 +13,47 @@
 
 extern membo_context_t *membo_context_list[MAX_NUMNODES];
 
-uint32_t dpu_rank_alloc(struct dpu_rank_t **rank)
+uint32_t dpu_rank_alloc_hint(struct dpu_rank_t **rank, uint32_t hint,
+			    struct dpu_rank_t **allocated, uint32_t nr_allocated)
 {
-	struct dpu_rank_t *rank_iterator;
+	struct dpu_rank_t *free_rank;
     int node;
 
 	*rank = NULL;
 
-    for_each_online_node(node)
-        list_for_each_entry (rank_iterator, &(membo_context_list[node]->rank_list), list) {
-            if (dpu_rank_get(rank_iterator) == DPU_OK) {
-                *rank = rank_iterator;
-                return DPU_OK;
-            }
+    for_each_online_node(node) {
+        membo_lock(node);
+        if (hint & DPU_RANK_ALLOC_SPREAD)
+            free_rank = membo_spread_free_rank(node, allocated, nr_allocated);
+        else
+            free_rank = membo_first_rank(node, MEMBO_RANK_FREE);
+        if (free_rank && dpu_rank_get(free_rank) == DPU_OK) {
+            membo_rank_set_state(free_rank, MEMBO_RANK_USED);
+            membo_unlock(node);
+            membo_pool_kick(node);
+            *rank = free_rank;
+            return DPU_OK;
         }
+        membo_unlock(node);
+    }
 
 	pr_warn("Failed to allocate rank, no available rank.\n");
 
 	return DPU_ERR_DRIVER;
 }
+EXPORT_SYMBOL(dpu_rank_alloc_hint);
+
+uint32_t dpu_rank_alloc(struct dpu_rank_t **rank)
+{
+	return dpu_rank_alloc_hint(rank, 0, NULL, 0);
+}
 EXPORT_SYMBOL(dpu_rank_alloc);
 
 uint32_t dpu_rank_free(struct dpu_rank_t *rank)
 {
+    membo_lock(rank->nid);
 	dpu_rank_put(rank);
+    membo_unlock(rank->nid);
 
 	return DPU_OK;
 }
@@ -48,15 +65,11 @@ EXPORT_SYMBOL(dpu_rank_free);
  */
 uint32_t dpu_get_number_of_available_ranks(void)
 {
-	struct dpu_rank_t *rank_iterator;
 	uint32_t nr_available = 0;
     int node;
 
     for_each_online_node(node)
-        list_for_each_entry (rank_iterator, &membo_context_list[node]->rank_list, list) {
-            if (rank_iterator->owner.is_owned == 0)
-                nr_available++;
-        }
+        nr_available += atomic_read(&membo_context_list[node]->nr_free_ranks);
 
 	return nr_available;
 }
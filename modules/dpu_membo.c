@@ -1,6 +1,15 @@
 #include <linux/nodemask.h>
 #include <linux/memory_hotplug.h>
 #include <linux/memory.h>
+#include <linux/ktime.h>
+#include <linux/vmstat.h>
+#include <linux/workqueue.h>
+#include <linux/slab.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/version.h>
 
 #include <dpu_membo.h>
 #include <dpu_membo_ioctl.h>
@@ -9,6 +18,61 @@
 bool membo_initialized = false;
 membo_context_t *membo_context_list[MAX_NUMNODES];
 struct dpu_membo_fs membo_fs;
+/* The background works of the nodes may run, between device creation and release */
+static bool membo_works_enabled;
+/* Page userspace maps to read the counters of the nodes without syscall */
+static struct dpu_membo_status *membo_status;
+
+/* Free ranks the pool reclaimer keeps, and borrowing leaves, on each node, 0: disabled */
+static unsigned int membo_pool_min_free_ranks;
+/* Free host pages a node must keep for the pool reclaimer to return a rank */
+static unsigned long membo_pool_min_free_pages;
+
+/*
+ * Damping of the kernel borrowing and reclamation requests: a section is
+ * only reclaimed if the node keeps membo_hysteresis_pages free pages above
+ * its high borrowing watermark, and if it was lent at least
+ * membo_min_residency jiffies ago. A node moves at most membo_rate_limit
+ * sections per second, 0: unlimited.
+ */
+static unsigned long membo_hysteresis_pages;
+static unsigned long membo_min_residency;
+static unsigned int membo_rate_limit;
+
+/* CPU time the compactor of a node may use per MEMBO_COMPACT_INTERVAL, 0: disabled */
+static unsigned int membo_compact_budget_ms;
+
+/* Lent ranks borrowing stripes sections over, 0 or 1: no striping */
+static unsigned int membo_borrow_stripe;
+
+/*
+ * Admission queue of the allocations waiting for ranks, by decreasing
+ * priority then in arrival order. Protected by membo_admission_lock, as
+ * membo_admission_stats.
+ */
+static LIST_HEAD(membo_admission_queue);
+static DEFINE_SPINLOCK(membo_admission_lock);
+static DECLARE_WAIT_QUEUE_HEAD(membo_admission_wait);
+static atomic_t membo_admission_depth = ATOMIC_INIT(0);
+/*
+ * Async allocations parked until ranks are released or lent, see
+ * membo_async_park. Protected by membo_admission_lock, membo_async_waiters
+ * counts them.
+ */
+static LIST_HEAD(membo_async_pending);
+static atomic_t membo_async_waiters = ATOMIC_INIT(0);
+
+struct membo_admission_stats {
+    unsigned long nr_queued;
+    unsigned long nr_granted;
+    unsigned long nr_timeouts;
+    unsigned long nr_interrupted;
+    /* Time the granted allocations waited */
+    unsigned long total_wait_ms;
+    unsigned long max_wait_ms;
+};
+
+static struct membo_admission_stats membo_admission_stats;
 
 int dpu_membo_dev_uevent(struct device *dev, struct kobj_uevent_env *env)
 {
@@ -18,334 +82,1832 @@ int dpu_membo_dev_uevent(struct device *dev, struct kobj_uevent_env *env)
 
 struct class *dpu_membo_class;
 
-static int dpu_membo_open(struct inode *inode, struct file *filp)
+static struct list_head *membo_state_list(membo_context_t *ctx,
+                                          enum membo_rank_state state)
 {
-    struct dpu_membo_fs *fs =
-        container_of(inode->i_cdev, struct dpu_membo_fs, cdev);
+    switch (state) {
+    case MEMBO_RANK_RESERVED:
+        return &ctx->reserved_rank_list;
+    case MEMBO_RANK_USED:
+        return &ctx->used_rank_list;
+    case MEMBO_RANK_LENT:
+        return &ctx->ltb_rank_list;
+    case MEMBO_RANK_RECLAIMING:
+        return &ctx->reclaiming_rank_list;
+    default:
+        return &ctx->free_rank_list;
+    }
+}
 
-    filp->private_data = fs;
+static atomic_t *membo_state_counter(membo_context_t *ctx,
+                                     enum membo_rank_state state)
+{
+    switch (state) {
+    case MEMBO_RANK_RESERVED:
+        return &ctx->nr_pending_ranks;
+    case MEMBO_RANK_USED:
+        return &ctx->nr_used_ranks;
+    case MEMBO_RANK_LENT:
+        return &ctx->nr_ltb_ranks;
+    case MEMBO_RANK_RECLAIMING:
+        return &ctx->nr_reclaiming_ranks;
+    default:
+        return &ctx->nr_free_ranks;
+    }
+}
 
-    membo_fs_lock();
-    if (fs->is_opened) {
-        membo_fs_unlock();
-        return 0;
+/*
+ * Must be called with the membo lock of the node held, which serializes the
+ * writers of a node. Publishes the counters of the node in the status page,
+ * after each change of them.
+ */
+static void membo_status_update(membo_context_t *ctx)
+{
+    struct dpu_membo_status *status_page = READ_ONCE(membo_status);
+    struct dpu_membo_node_status *status;
+
+    if (!status_page || ctx->nid >= DPU_MEMBO_STATUS_MAX_NODES)
+        return;
+
+    status = &status_page->nodes[ctx->nid];
+
+    WRITE_ONCE(status->seq, status->seq + 1);
+    smp_wmb();
+    WRITE_ONCE(status->nr_total_ranks, atomic_read(&ctx->nr_total_ranks));
+    WRITE_ONCE(status->nr_free_ranks, atomic_read(&ctx->nr_free_ranks));
+    WRITE_ONCE(status->nr_pending_ranks, atomic_read(&ctx->nr_pending_ranks));
+    WRITE_ONCE(status->nr_used_ranks, atomic_read(&ctx->nr_used_ranks));
+    WRITE_ONCE(status->nr_lent_ranks, atomic_read(&ctx->nr_ltb_ranks));
+    WRITE_ONCE(status->nr_reclaiming_ranks, atomic_read(&ctx->nr_reclaiming_ranks));
+    WRITE_ONCE(status->nr_borrowed_sections, ctx->nr_ltb_sections);
+    smp_wmb();
+    WRITE_ONCE(status->seq, status->seq + 1);
+}
+
+/* Must be called with the membo lock of the rank node held */
+static void membo_add_rank_sections(struct dpu_rank_t *rank, int nr_sections)
+{
+    membo_context_t *ctx = membo_context_list[rank->nid];
+
+    atomic_add(nr_sections, &rank->nr_ltb_sections);
+    ctx->nr_ltb_sections += nr_sections;
+    membo_status_update(ctx);
+}
+
+/* Called once per rank, when its device is created */
+void membo_add_rank(struct dpu_rank_t *rank)
+{
+    membo_context_t *ctx = membo_context_list[rank->nid];
+
+    membo_lock(rank->nid);
+    atomic_set(&rank->nr_ltb_sections, 0);
+    bitmap_zero(rank->ltb_sections, SECTIONS_PER_DPU_RANK);
+    list_add_tail(&rank->list, &ctx->rank_list);
+    rank->membo_state = MEMBO_RANK_FREE;
+    list_add_tail(&rank->state_list, &ctx->free_rank_list);
+    atomic_inc(&ctx->nr_free_ranks);
+    atomic_inc(&ctx->nr_total_ranks);
+    membo_status_update(ctx);
+    membo_unlock(rank->nid);
+}
+
+/* Undoes membo_add_rank when the rank device goes away */
+void membo_remove_rank(struct dpu_rank_t *rank)
+{
+    membo_context_t *ctx = membo_context_list[rank->nid];
+
+    membo_lock(rank->nid);
+    list_del(&rank->list);
+    list_del(&rank->state_list);
+    atomic_dec(membo_state_counter(ctx, rank->membo_state));
+    atomic_dec(&ctx->nr_total_ranks);
+    ctx->nr_ltb_sections -= atomic_read(&rank->nr_ltb_sections);
+    if (ctx->ltb_index == rank)
+        ctx->ltb_index = NULL;
+    membo_status_update(ctx);
+    membo_unlock(rank->nid);
+}
+
+/* Must be called with the membo lock of the node held */
+struct dpu_rank_t *membo_first_rank(int nid, enum membo_rank_state state)
+{
+    return list_first_entry_or_null(membo_state_list(membo_context_list[nid], state),
+                                    struct dpu_rank_t, state_list);
+}
+
+/* 2: another channel, 1: same channel but another DIMM, 0: same DIMM */
+static int membo_rank_distance(struct dpu_rank_t *rank, struct dpu_rank_t *other)
+{
+    if (rank->nid != other->nid || rank->channel_id != other->channel_id)
+        return 2;
+
+    /* DIMMs are told apart by their serial number, or else their slot */
+    if (rank->serial_number[0] && other->serial_number[0])
+        return strcmp(rank->serial_number, other->serial_number) ? 1 : 0;
+
+    return rank->slot_index != other->slot_index ? 1 : 0;
+}
+
+/*
+ * Must be called with the membo lock of the node held. Returns the free rank
+ * of the node on a channel, or else a DIMM, that none of the nr_spread ranks
+ * of spread uses, falling back on the first free rank.
+ */
+struct dpu_rank_t *membo_spread_free_rank(int nid, struct dpu_rank_t **spread,
+                                          int nr_spread)
+{
+    struct dpu_rank_t *rank_iterator, *best_rank = NULL;
+    int best_distance = -1;
+
+    list_for_each_entry (rank_iterator, &membo_context_list[nid]->free_rank_list, state_list) {
+        int distance = 2;
+        int i;
+
+        for (i = 0; i < nr_spread && distance; i++)
+            distance = min(distance, membo_rank_distance(rank_iterator, spread[i]));
+
+        if (distance == 2)
+            return rank_iterator;
+
+        if (distance > best_distance) {
+            best_rank = rank_iterator;
+            best_distance = distance;
+        }
     }
 
-    fs->is_opened = true;
-    membo_fs_unlock();
+    return best_rank;
+}
 
-    return 0;
+static void membo_async_kick(void);
+
+/* Lets the queued allocations check whether enough ranks are available now */
+static void membo_admission_kick(void)
+{
+    if (atomic_read(&membo_admission_depth))
+        wake_up_all(&membo_admission_wait);
+    if (atomic_read(&membo_async_waiters))
+        membo_async_kick();
 }
 
-static int dpu_membo_release(struct inode *inode, struct file *filp)
+/* Must be called with the membo lock of the rank node held */
+void membo_rank_set_state(struct dpu_rank_t *rank, enum membo_rank_state state)
 {
-    struct dpu_membo_fs *fs = filp->private_data;
+    membo_context_t *ctx = membo_context_list[rank->nid];
 
-    if (!fs)
-        return 0;
+    if (rank->membo_state == state)
+        return;
 
-    membo_fs_lock();
-    fs->is_opened = false;
-    membo_fs_unlock();
+    atomic_dec(membo_state_counter(ctx, rank->membo_state));
+    list_move_tail(&rank->state_list, membo_state_list(ctx, state));
+    rank->membo_state = state;
 
-    return 0;
+    /* Borrowing may resume now that a rank is free again */
+    if (atomic_inc_return(membo_state_counter(ctx, state)) == 1 &&
+        state == MEMBO_RANK_FREE)
+        atomic_set(&NODE_DATA(rank->nid)->membo_disabled, 0);
+
+    membo_status_update(ctx);
+
+    if (state == MEMBO_RANK_FREE || state == MEMBO_RANK_LENT)
+        membo_admission_kick();
 }
 
-static int reclaim_one_rank(struct dpu_rank_t *rank)
+static uint32_t reclaim_one_section(struct dpu_rank_t *rank, int section_id)
 {
     struct page *page = virt_to_page(rank->region->base);
     struct memory_block *mem = container_of(rank->dev.parent, struct memory_block, dev);
-    unsigned long pfn;
 
-    for (pfn = page_to_pfn(page); pfn < page_to_pfn(page) + PAGES_PER_SECTION * atomic_read(&rank->nr_ltb_sections); pfn += PAGES_PER_SECTION) {
-        reclaim_mram_pages(pfn, PAGES_PER_SECTION, mem->group, &rank->region->dpu_dax_dev.pgmap);
-    }
+    reclaim_mram_pages(page_to_pfn(page) + section_id * PAGES_PER_SECTION, PAGES_PER_SECTION, mem->group, &rank->region->dpu_dax_dev.pgmap);
+    return 0;
+}
 
-    atomic_set(&rank->nr_ltb_sections, 0);
-    dpu_membo_rank_free(&rank, rank->nid);
+static unsigned long membo_node_free_pages(int nid)
+{
+    pg_data_t *pgdat = NODE_DATA(nid);
+    unsigned long nr_free_pages = 0;
+    int i;
 
-    return 0;
+    for (i = 0; i < MAX_NR_ZONES; i++)
+        nr_free_pages += zone_page_state(&pgdat->node_zones[i], NR_FREE_PAGES);
+
+    return nr_free_pages;
 }
 
-static int direct_reclaim_ranks(int nr_ranks)
+/* Must be called with the membo lock of the node held */
+static void membo_update_ltb_index(int nid)
 {
-    struct dpu_rank_t *rank_iterator, *tmp;
-    int node;
-    int nr_req_target = nr_ranks;
+    membo_context_t *ctx = membo_context_list[nid];
 
-    /* reclaim nr_req_ranks ranks */
-    for_each_online_node(node)
-        list_for_each_entry_safe (rank_iterator, tmp, &membo_context_list[node]->ltb_rank_list, list) {
-            reclaim_one_rank(rank_iterator);
+    /* Ranks are lent in order, the last one is the most recent */
+    if (list_empty(&ctx->ltb_rank_list))
+        ctx->ltb_index = NULL;
+    else
+        ctx->ltb_index = list_last_entry(&ctx->ltb_rank_list, struct dpu_rank_t, state_list);
+}
+
+struct membo_reclaim_cost {
+    int nr_sections;
+    unsigned long nr_free_pages;
+    bool fits;
+    unsigned int heat;
+};
+
+/*
+ * Reclaiming a rank migrates all the pages of its lent sections: the best
+ * victim is the lent rank with the fewest sections, on a node with enough
+ * free memory to take its pages, then the coldest one, and then the node
+ * with the most free memory.
+ */
+static bool membo_reclaim_cheaper(const struct membo_reclaim_cost *a,
+                                  const struct membo_reclaim_cost *b)
+{
+    if (a->fits != b->fits)
+        return a->fits;
+    if (a->nr_sections != b->nr_sections)
+        return a->nr_sections < b->nr_sections;
+    if (a->heat != b->heat)
+        return a->heat < b->heat;
+    return a->nr_free_pages > b->nr_free_pages;
+}
+
+static unsigned int membo_rank_heat(struct dpu_rank_t *rank)
+{
+    unsigned int section_id, heat = 0;
+
+    for_each_set_bit (section_id, rank->ltb_sections, SECTIONS_PER_DPU_RANK)
+        heat += rank->ltb_heat[section_id];
+
+    return heat;
+}
+
+/* Must be called with the membo lock of the node held */
+static struct dpu_rank_t *pick_reclaim_victim(int nid, struct membo_reclaim_cost *cost)
+{
+    struct dpu_rank_t *rank_iterator, *victim = NULL;
+    unsigned long nr_free_pages;
+
+    if (list_empty(&membo_context_list[nid]->ltb_rank_list))
+        return NULL;
+
+    nr_free_pages = membo_node_free_pages(nid);
+
+    list_for_each_entry (rank_iterator, &membo_context_list[nid]->ltb_rank_list, state_list) {
+        struct membo_reclaim_cost rank_cost = {
+            .nr_sections = atomic_read(&rank_iterator->nr_ltb_sections),
+            .nr_free_pages = nr_free_pages,
+        };
+
+        rank_cost.fits = nr_free_pages >= rank_cost.nr_sections * PAGES_PER_SECTION;
+        rank_cost.heat = membo_rank_heat(rank_iterator);
+
+        if (victim && !membo_reclaim_cheaper(&rank_cost, cost))
+            continue;
+
+        victim = rank_iterator;
+        *cost = rank_cost;
+    }
+
+    return victim;
+}
+
+/*
+ * Takes the cheapest lent rank of the online nodes of nodes out of
+ * ltb_rank_list: in the RECLAIMING state, neither the borrowing nor the
+ * reclamation callbacks can pick it, so its sections can be migrated
+ * without the membo lock. Each node lock is only held while its list is
+ * looked at.
+ */
+static struct dpu_rank_t *claim_reclaim_victim(const nodemask_t *nodes)
+{
+    struct membo_reclaim_cost cost, best_cost;
+    struct dpu_rank_t *victim;
+    int nid, best_nid;
+
+retry:
+    best_nid = NUMA_NO_NODE;
+    for_each_node_mask(nid, *nodes) {
+        if (!node_online(nid))
+            continue;
 
-            if (--nr_req_target == 0)
-                goto end;
+        membo_lock(nid);
+        victim = pick_reclaim_victim(nid, &cost);
+        membo_unlock(nid);
+
+        if (victim && (best_nid == NUMA_NO_NODE || membo_reclaim_cheaper(&cost, &best_cost))) {
+            best_nid = nid;
+            best_cost = cost;
         }
+    }
 
-end:
-    return 0;
+    if (best_nid == NUMA_NO_NODE)
+        return NULL;
+
+    membo_lock(best_nid);
+    victim = pick_reclaim_victim(best_nid, &cost);
+    if (victim) {
+        membo_rank_set_state(victim, MEMBO_RANK_RECLAIMING);
+        membo_update_ltb_index(best_nid);
+    }
+    membo_unlock(best_nid);
+
+    /* The node ranks were all reclaimed in between */
+    if (!victim)
+        goto retry;
+
+    return victim;
 }
 
-static int direct_reclaim_ranks_node(int nr_ranks, int node)
+static int claim_reclaim_victims(struct dpu_rank_t **victims, int nr_ranks,
+                                 const nodemask_t *nodes)
 {
-    struct dpu_rank_t *rank_iterator, *tmp;
-    int nr_req_target = nr_ranks;
+    int nr_victims = 0;
 
-    /* reclaim nr_req_ranks ranks */
-    list_for_each_entry_safe (rank_iterator, tmp, &membo_context_list[node]->ltb_rank_list, list) {
-        reclaim_one_rank(rank_iterator);
+    /* claim nr_ranks ranks, the cheapest first */
+    while (nr_victims < nr_ranks && (victims[nr_victims] = claim_reclaim_victim(nodes)))
+        nr_victims++;
 
-        if (--nr_req_target == 0)
-            goto end;
+    return nr_victims;
+}
+
+/* Gives claimed victims back to the system memory, untouched */
+static void release_reclaim_victims(struct dpu_rank_t **victims, int nr_victims)
+{
+    int i;
+
+    for (i = 0; i < nr_victims; i++) {
+        membo_lock(victims[i]->nid);
+        membo_rank_set_state(victims[i], MEMBO_RANK_LENT);
+        membo_update_ltb_index(victims[i]->nid);
+        membo_unlock(victims[i]->nid);
     }
+}
 
-end:
-    return 0;
+/*
+ * Reclaims the claimed victims and moves them to state. No membo lock is
+ * held meanwhile, so borrowing goes on on every node. The sections are
+ * reclaimed one after the other: offlining takes the memory hotplug lock,
+ * concurrent reclaimers would only queue up on it.
+ */
+static void reclaim_ranks(struct dpu_rank_t **victims, int nr_victims,
+                          enum membo_rank_state state)
+{
+    unsigned long section_id;
+    int i;
+
+    for (i = 0; i < nr_victims; i++)
+        for_each_set_bit (section_id, victims[i]->ltb_sections, SECTIONS_PER_DPU_RANK)
+            reclaim_one_section(victims[i], section_id);
+
+    for (i = 0; i < nr_victims; i++) {
+        struct dpu_rank_t *rank = victims[i];
+        int nid = rank->nid;
+
+        membo_lock(nid);
+        bitmap_zero(rank->ltb_sections, SECTIONS_PER_DPU_RANK);
+        membo_add_rank_sections(rank, -atomic_read(&rank->nr_ltb_sections));
+        dpu_membo_rank_free(&rank, nid);
+        membo_rank_set_state(rank, state);
+        membo_unlock(nid);
+    }
+}
+
+/*
+ * Pool reclaimer: returns lent ranks of the node until it has
+ * membo_pool_min_free_ranks free ranks, as long as the host memory of the
+ * node stays above membo_pool_min_free_pages, so that allocations seldom
+ * have to reclaim ranks themselves.
+ */
+static void membo_pool_work_fn(struct work_struct *work)
+{
+    membo_context_t *ctx = container_of(to_delayed_work(work), membo_context_t, pool_work);
+    nodemask_t nodes = nodemask_of_node(ctx->nid);
+    struct dpu_rank_t *victim;
+
+    while (atomic_read(&ctx->nr_free_ranks) < READ_ONCE(membo_pool_min_free_ranks)) {
+        if (!claim_reclaim_victims(&victim, 1, &nodes))
+            break;
+
+        /* Host memory is under pressure, keep the rank lent */
+        if (membo_node_free_pages(ctx->nid) <
+            READ_ONCE(membo_pool_min_free_pages) +
+            atomic_read(&victim->nr_ltb_sections) * PAGES_PER_SECTION) {
+            release_reclaim_victims(&victim, 1);
+            break;
+        }
+
+        reclaim_ranks(&victim, 1, MEMBO_RANK_FREE);
+    }
+
+    if (READ_ONCE(membo_pool_min_free_ranks))
+        queue_delayed_work(system_unbound_wq, &ctx->pool_work, MEMBO_POOL_INTERVAL);
 }
 
-static int reserve_ranks_for_allocation(int nr_ranks)
+/* Runs the pool reclaimer of the node now, when free ranks have been taken */
+void membo_pool_kick(int nid)
+{
+    if (READ_ONCE(membo_pool_min_free_ranks) && READ_ONCE(membo_works_enabled))
+        mod_delayed_work(system_unbound_wq, &membo_context_list[nid]->pool_work, 0);
+}
+
+static void membo_pool_kick_all(void)
 {
-    struct dpu_rank_t *rank_iterator, *tmp;
     int node;
-    int nr_req_target = nr_ranks;
 
     for_each_online_node(node)
-        list_for_each_entry_safe (rank_iterator, tmp, &membo_context_list[node]->rank_list, list) {
-            if (!rank_iterator->is_reserved) {
-                /* the rank is reserved for allocation */
-                rank_iterator->is_reserved = true;
-                atomic_dec(&membo_context_list[rank_iterator->nid]->nr_free_ranks);
-                if (--nr_req_target == 0)
-                    goto end;
-            }
-        }
-end:
-    return 0;
+        membo_pool_kick(node);
 }
 
-static int dpu_membo_alloc_ranks_direct(unsigned long ptr)
+/*
+ * Moves free ranks of the online nodes of nodes to the RESERVED state, and
+ * appends them to the nr_reserved ranks of ranks, up to nr_ranks. With
+ * spread, each rank is taken on a channel, or else a DIMM, that the ranks
+ * already in ranks do not use. Returns the new number of ranks in ranks.
+ */
+static int reserve_ranks_for_allocation(struct dpu_rank_t **ranks, int nr_reserved,
+                                        int nr_ranks, const nodemask_t *nodes,
+                                        bool spread)
 {
-    struct dpu_membo_allocation_context allocation_context;
+    struct dpu_rank_t *rank;
     int node;
-    int nr_free_ranks = 0;
-    int nr_ltb_ranks = 0;
-    int nr_reclamation_ranks = 0;
-    int nr_reserved_ranks = 0;
 
-    if (copy_from_user(&allocation_context, (void *)ptr, sizeof(allocation_context)))
-        return -EFAULT;
+    if (nr_reserved >= nr_ranks)
+        return nr_reserved;
+
+    for_each_node_mask(node, *nodes) {
+        if (!node_online(node))
+            continue;
 
-    /* we must lock membo on each node */
-    for_each_online_node(node)
         membo_lock(node);
+        while (nr_reserved < nr_ranks &&
+               (rank = spread ? membo_spread_free_rank(node, ranks, nr_reserved) :
+                                membo_first_rank(node, MEMBO_RANK_FREE))) {
+            /* the rank is reserved for allocation */
+            membo_rank_set_state(rank, MEMBO_RANK_RESERVED);
+            ranks[nr_reserved++] = rank;
+        }
+        membo_unlock(node);
 
-    for_each_online_node(node)
-        nr_free_ranks += atomic_read(&membo_context_list[node]->nr_free_ranks);
+        if (nr_reserved == nr_ranks)
+            break;
+    }
 
-    for_each_online_node(node) {
-        nr_ltb_ranks += atomic_read(&membo_context_list[node]->nr_ltb_ranks);
-        nr_reserved_ranks += atomic_read(&membo_context_list[node]->nr_reserved_ranks);
+    return nr_reserved;
+}
+
+static void unreserve_ranks(struct dpu_rank_t **ranks, int nr_ranks)
+{
+    int i;
+
+    for (i = 0; i < nr_ranks; i++) {
+        membo_lock(ranks[i]->nid);
+        if (ranks[i]->membo_state == MEMBO_RANK_RESERVED)
+            membo_rank_set_state(ranks[i], MEMBO_RANK_FREE);
+        membo_unlock(ranks[i]->nid);
     }
+}
 
-    pr_info("membo: threshold is: %d ranks\n", nr_reserved_ranks);
-    if (allocation_context.nr_req_ranks <= nr_free_ranks) {
-        pr_info("membo: allocation without direct reclamation\n");
-        goto reserve_ranks;
+/* Number of ranks in state on the online nodes of nodes, read without lock */
+static int membo_nr_ranks(enum membo_rank_state state, const nodemask_t *nodes)
+{
+    int node;
+    int nr_ranks = 0;
+
+    for_each_node_mask(node, *nodes)
+        if (node_online(node))
+            nr_ranks += atomic_read(membo_state_counter(membo_context_list[node], state));
+
+    return nr_ranks;
+}
+
+/*
+ * Splits the online nodes in the order an allocation should take its ranks
+ * from: nodes[0] first, then nodes[1]. Returns the number of node sets.
+ */
+static int membo_allocation_nodes(struct dpu_membo_allocation_context *allocation_context,
+                                  nodemask_t nodes[2])
+{
+    int node;
+
+    nodes_clear(nodes[0]);
+    for (node = 0; node < min(MAX_NUMNODES, 64); node++)
+        if (allocation_context->node_mask & (1ULL << node))
+            node_set(node, nodes[0]);
+    nodes_and(nodes[0], nodes[0], node_online_map);
+
+    switch (allocation_context->node_policy) {
+    case DPU_MEMBO_NODE_ANY:
+        nodes[0] = node_online_map;
+        return 1;
+    case DPU_MEMBO_NODE_STRICT:
+        return nodes_empty(nodes[0]) ? -EINVAL : 1;
+    case DPU_MEMBO_NODE_PREFERRED:
+        if (nodes_empty(nodes[0]))
+            return -EINVAL;
+        nodes_andnot(nodes[1], node_online_map, nodes[0]);
+        return 2;
+    default:
+        return -EINVAL;
     }
+}
 
-    if (allocation_context.nr_req_ranks <= nr_free_ranks + nr_ltb_ranks) {
-        /* we can get enough ranks after relcaiming (nr_req_ranks - nr_free_ranks) ranks */
-        nr_reclamation_ranks = allocation_context.nr_req_ranks - nr_free_ranks;
-        pr_info("membo: trigger direct reclamation: %d ranks\n", nr_reclamation_ranks);
-        direct_reclaim_ranks(nr_reclamation_ranks);
-    } else {
-        for_each_online_node(node)
-            membo_unlock(node);
-        return -EBUSY;
+/* An allocation of DPU_MEMBO_ALLOC_WAIT in the admission queue */
+struct membo_waiter {
+    struct list_head list;
+    uint32_t priority;
+    int nr_ranks;
+    nodemask_t nodes;
+    unsigned long enqueued;
+    /* In jiffies, MAX_SCHEDULE_TIMEOUT: no timeout */
+    unsigned long timeout;
+    bool granted;
+};
+
+static bool membo_admission_granted(struct membo_waiter *waiter)
+{
+    bool granted;
+
+    spin_lock(&membo_admission_lock);
+    granted = list_first_entry(&membo_admission_queue, struct membo_waiter, list) == waiter &&
+              waiter->nr_ranks <= membo_nr_ranks(MEMBO_RANK_FREE, &waiter->nodes) +
+                                  membo_nr_ranks(MEMBO_RANK_LENT, &waiter->nodes);
+    spin_unlock(&membo_admission_lock);
+
+    return granted;
+}
+
+/*
+ * Waits until the waiter is the first of the admission queue and enough
+ * ranks are free or lent on its nodes, for what is left of its timeout.
+ */
+static int membo_admission_wait_for(struct membo_waiter *waiter)
+{
+    long timeout = MAX_SCHEDULE_TIMEOUT;
+    unsigned int wait_ms;
+    long ret;
+
+    if (waiter->timeout != MAX_SCHEDULE_TIMEOUT)
+        timeout = max_t(long, (long)(waiter->enqueued + waiter->timeout - jiffies), 0);
+
+    ret = wait_event_interruptible_timeout(membo_admission_wait,
+                                           membo_admission_granted(waiter), timeout);
+    if (ret > 0) {
+        if (!waiter->granted) {
+            waiter->granted = true;
+            wait_ms = jiffies_to_msecs(jiffies - waiter->enqueued);
+
+            spin_lock(&membo_admission_lock);
+            membo_admission_stats.nr_granted++;
+            membo_admission_stats.total_wait_ms += wait_ms;
+            if (wait_ms > membo_admission_stats.max_wait_ms)
+                membo_admission_stats.max_wait_ms = wait_ms;
+            spin_unlock(&membo_admission_lock);
+        }
+        return 0;
     }
 
-reserve_ranks:
-    reserve_ranks_for_allocation(allocation_context.nr_req_ranks);
+    spin_lock(&membo_admission_lock);
+    if (ret)
+        membo_admission_stats.nr_interrupted++;
+    else
+        membo_admission_stats.nr_timeouts++;
+    spin_unlock(&membo_admission_lock);
 
-    for_each_online_node(node)
-        membo_unlock(node);
-    return 0;
+    return ret ? -EINTR : -ETIMEDOUT;
 }
 
-static int dpu_membo_alloc_ranks_async(unsigned long ptr)
+/* Leaves the admission queue, the next allocation may be granted */
+static void membo_admission_leave(struct membo_waiter *waiter)
 {
-    struct dpu_membo_allocation_context allocation_context;
-    int node;
-    int nr_free_ranks = 0;
-    int nr_ltb_ranks = 0;
+    spin_lock(&membo_admission_lock);
+    list_del(&waiter->list);
+    spin_unlock(&membo_admission_lock);
+
+    atomic_dec(&membo_admission_depth);
+    wake_up_all(&membo_admission_wait);
+}
+
+/*
+ * Queues an allocation of DPU_MEMBO_ALLOC_WAIT behind those of higher or
+ * equal priority, and waits until it is granted. A granted allocation stays
+ * first of the queue until membo_admission_leave, so that the following
+ * ones cannot take its ranks in the meantime. Allocations without
+ * DPU_MEMBO_ALLOC_WAIT fail while the queue is not empty, so they cannot
+ * starve the queued ones either.
+ */
+static int membo_admission_enter(struct membo_waiter *waiter,
+                                 struct dpu_membo_allocation_context *allocation_context,
+                                 const nodemask_t *nodes)
+{
+    struct membo_waiter *iter;
+    int node, nr_total_ranks = 0;
+    int ret;
+
+    /* Never granted */
+    for_each_node_mask(node, *nodes)
+        if (node_online(node))
+            nr_total_ranks += atomic_read(&membo_context_list[node]->nr_total_ranks);
+    if (allocation_context->nr_req_ranks > nr_total_ranks)
+        return -EBUSY;
+
+    waiter->priority = allocation_context->priority;
+    waiter->nr_ranks = allocation_context->nr_req_ranks;
+    waiter->nodes = *nodes;
+    waiter->enqueued = jiffies;
+    waiter->timeout = allocation_context->timeout_ms ?
+                      msecs_to_jiffies(allocation_context->timeout_ms) : MAX_SCHEDULE_TIMEOUT;
+    waiter->granted = false;
+
+    spin_lock(&membo_admission_lock);
+    list_for_each_entry (iter, &membo_admission_queue, list)
+        if (iter->priority < waiter->priority)
+            break;
+    /* Before the first waiter of lower priority, or last */
+    list_add_tail(&waiter->list, &iter->list);
+    membo_admission_stats.nr_queued++;
+    spin_unlock(&membo_admission_lock);
+    atomic_inc(&membo_admission_depth);
+
+    ret = membo_admission_wait_for(waiter);
+    if (ret)
+        membo_admission_leave(waiter);
+
+    return ret;
+}
 
-    if (copy_from_user(&allocation_context, (void *)ptr, sizeof(allocation_context)))
+static int dpu_membo_alloc_ranks_direct(unsigned long ptr, size_t size)
+{
+    struct dpu_membo_allocation_context allocation_context;
+    struct dpu_rank_t **ranks, **victims;
+    struct membo_waiter waiter;
+    nodemask_t nodes[2], allowed_nodes;
+    int nr_req_ranks, nr_ranks, nr_victims;
+    int i, nr_node_sets, ret = 0;
+    bool spread, wait;
+
+    /* Legacy callers only pass the leading fields */
+    memset(&allocation_context, 0, sizeof(allocation_context));
+    if (copy_from_user(&allocation_context, (void *)ptr, size))
         return -EFAULT;
 
-    /* we must lock membo on each node */
-    for_each_online_node(node)
-        membo_lock(node);
+    nr_req_ranks = allocation_context.nr_req_ranks;
+    if (nr_req_ranks <= 0)
+        return 0;
+    if (nr_req_ranks > DPU_MEMBO_MAX_ALLOC_RANKS ||
+        allocation_context.flags & ~DPU_MEMBO_ALLOC_FLAGS)
+        return -EINVAL;
 
-    for_each_online_node(node)
-        nr_free_ranks += atomic_read(&membo_context_list[node]->nr_free_ranks);
+    spread = allocation_context.flags & DPU_MEMBO_ALLOC_SPREAD;
+    wait = allocation_context.flags & DPU_MEMBO_ALLOC_WAIT;
+
+    nr_node_sets = membo_allocation_nodes(&allocation_context, nodes);
+    if (nr_node_sets < 0)
+        return nr_node_sets;
+
+    allowed_nodes = nodes[0];
+    if (nr_node_sets == 2)
+        nodes_or(allowed_nodes, nodes[0], nodes[1]);
 
-    /* We can get enough ranks without doing the direct reclamation */
-    if (allocation_context.nr_req_ranks <= nr_free_ranks) {
-        allocation_context.nr_alloc_ranks = allocation_context.nr_req_ranks;
-        goto reserve_ranks;
+    ranks = kcalloc(2 * nr_req_ranks, sizeof(*ranks), GFP_KERNEL);
+    if (!ranks)
+        return -ENOMEM;
+    victims = ranks + nr_req_ranks;
+
+    if (wait) {
+        ret = membo_admission_enter(&waiter, &allocation_context, &allowed_nodes);
+        if (ret) {
+            kfree(ranks);
+            return ret;
+        }
+    } else if (atomic_read(&membo_admission_depth) ||
+               nr_req_ranks > membo_nr_ranks(MEMBO_RANK_FREE, &allowed_nodes) +
+                              membo_nr_ranks(MEMBO_RANK_LENT, &allowed_nodes)) {
+        kfree(ranks);
+        return -EBUSY;
     }
 
-    for_each_online_node(node)
-        nr_ltb_ranks += atomic_read(&membo_context_list[node]->nr_ltb_ranks);
-
-    if (nr_free_ranks + nr_ltb_ranks >= allocation_context.nr_req_ranks) {
-        if (nr_free_ranks == 0) {
-            direct_reclaim_ranks(1);
-            allocation_context.nr_alloc_ranks = 1;
-        } else {
-            /* Give the free ranks to the user immediately */
-            allocation_context.nr_alloc_ranks = nr_free_ranks;
+retry:
+    nr_ranks = 0;
+    nr_victims = 0;
+
+    /* Free ranks, then lent ranks, of the preferred nodes before the others */
+    for (i = 0; i < nr_node_sets && nr_ranks + nr_victims < nr_req_ranks; i++) {
+        nr_ranks = reserve_ranks_for_allocation(ranks, nr_ranks, nr_req_ranks - nr_victims,
+                                                &nodes[i], spread);
+        nr_victims += claim_reclaim_victims(victims + nr_victims,
+                                            nr_req_ranks - nr_ranks - nr_victims, &nodes[i]);
+    }
+
+    if (nr_ranks + nr_victims < nr_req_ranks) {
+        release_reclaim_victims(victims, nr_victims);
+        unreserve_ranks(ranks, nr_ranks);
+
+        /* Ranks being reclaimed by others, wait for them */
+        if (wait) {
+            ret = membo_admission_wait_for(&waiter);
+            if (!ret)
+                goto retry;
+            membo_admission_leave(&waiter);
+            kfree(ranks);
+            return ret;
         }
-        goto reserve_ranks;
-    } else {
-        for_each_online_node(node)
-            membo_unlock(node);
+
+        kfree(ranks);
         return -EBUSY;
     }
 
-reserve_ranks:
-    if (copy_to_user((void *)ptr, &allocation_context, sizeof(allocation_context))) {
-        for_each_online_node(node)
-            membo_unlock(node);
-        return -EFAULT;
+    if (nr_victims) {
+        /* we get enough ranks after relcaiming nr_victims ranks */
+        pr_info("membo: trigger direct reclamation: %d ranks\n", nr_victims);
+        reclaim_ranks(victims, nr_victims, MEMBO_RANK_RESERVED);
+    } else {
+        pr_info("membo: allocation without direct reclamation\n");
     }
 
-    reserve_ranks_for_allocation(allocation_context.nr_alloc_ranks);
+    /* The victims follow the free ranks in the array */
+    memmove(ranks + nr_ranks, victims, nr_victims * sizeof(*ranks));
 
-    for_each_online_node(node)
-        membo_unlock(node);
+    allocation_context.nr_alloc_ranks = nr_req_ranks;
+    allocation_context.request_id = 0;
+    for (i = 0; i < nr_req_ranks; i++) {
+        allocation_context.rank_nids[i] = ranks[i]->nid;
+        allocation_context.rank_ids[i] = ranks[i]->id;
+    }
 
-    return 0;
+    if (copy_to_user((void *)ptr, &allocation_context, size)) {
+        unreserve_ranks(ranks, nr_req_ranks);
+        ret = -EFAULT;
+    }
+
+    if (wait)
+        membo_admission_leave(&waiter);
+
+    kfree(ranks);
+    membo_pool_kick_all();
+    return ret;
+}
+
+/*
+ * Ranks of an async allocation that were not free when the ioctl returned.
+ * The worker reserves them as they get free or reclaimed, and reports each
+ * of them with an event on the file.
+ */
+struct membo_async_request {
+    struct delayed_work work;
+    /* In file->requests */
+    struct list_head list;
+    /* In membo_async_pending while parked */
+    struct list_head pending;
+    struct dpu_membo_file *file;
+    uint32_t id;
+    nodemask_t nodes[2];
+    int nr_node_sets;
+    bool spread;
+    int nr_req_ranks;
+    int nr_ranks;
+    struct dpu_rank_t *ranks[DPU_MEMBO_MAX_ALLOC_RANKS];
+    /* Lent ranks claimed by the ioctl, the worker reclaims them first */
+    struct dpu_rank_t *victims[DPU_MEMBO_MAX_ALLOC_RANKS];
+    int nr_victims;
+    int next_victim;
+    /* In jiffies, MAX_SCHEDULE_TIMEOUT: no timeout */
+    long timeout;
+    unsigned long deadline;
+    /* Set when the file is released, under membo_admission_lock */
+    bool cancelled;
+    /* Set last by the worker, the request can then be freed */
+    bool done;
+};
+
+struct membo_event_entry {
+    struct list_head list;
+    struct dpu_membo_event event;
+};
+
+static void membo_post_event(struct membo_async_request *req, int status,
+                             struct dpu_rank_t *rank)
+{
+    struct dpu_membo_file *file = req->file;
+    struct membo_event_entry *entry;
+
+    entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+    if (!entry) {
+        pr_warn("membo: lost an event of request %u\n", req->id);
+        return;
+    }
+
+    entry->event.request_id = req->id;
+    entry->event.status = status;
+    entry->event.nid = rank ? rank->nid : -1;
+    entry->event.rank_id = rank ? rank->id : -1;
+    entry->event.nr_remaining = req->nr_req_ranks - req->nr_ranks;
+
+    spin_lock(&file->lock);
+    list_add_tail(&entry->list, &file->events);
+    spin_unlock(&file->lock);
+
+    wake_up_interruptible(&file->wait);
+}
+
+/* Whether free or lent ranks are left for the request, read without lock */
+static bool membo_async_ranks_available(struct membo_async_request *req)
+{
+    int i;
+
+    for (i = 0; i < req->nr_node_sets; i++)
+        if (membo_nr_ranks(MEMBO_RANK_FREE, &req->nodes[i]) +
+            membo_nr_ranks(MEMBO_RANK_LENT, &req->nodes[i]))
+            return true;
+
+    return false;
+}
+
+/*
+ * Reserves one more rank for the request: a victim claimed by the ioctl,
+ * else a free rank, or else a reclaimed lent rank, of the preferred nodes
+ * first. Returns false if there is none.
+ */
+static bool membo_async_take_rank(struct membo_async_request *req)
+{
+    struct dpu_rank_t *rank;
+    int i;
+
+    if (req->next_victim < req->nr_victims) {
+        rank = req->victims[req->next_victim++];
+        reclaim_ranks(&rank, 1, MEMBO_RANK_RESERVED);
+        req->ranks[req->nr_ranks] = rank;
+        return true;
+    }
+
+    for (i = 0; i < req->nr_node_sets; i++) {
+        if (reserve_ranks_for_allocation(req->ranks, req->nr_ranks, req->nr_ranks + 1,
+                                         &req->nodes[i], req->spread) > req->nr_ranks)
+            return true;
+
+        if (claim_reclaim_victims(&rank, 1, &req->nodes[i])) {
+            reclaim_ranks(&rank, 1, MEMBO_RANK_RESERVED);
+            req->ranks[req->nr_ranks] = rank;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Gives back the victims the worker has not reclaimed */
+static void membo_async_release_victims(struct membo_async_request *req)
+{
+    release_reclaim_victims(req->victims + req->next_victim,
+                            req->nr_victims - req->next_victim);
+    req->next_victim = req->nr_victims;
+}
+
+/* Runs the parked requests again, ranks were released or lent */
+static void membo_async_kick(void)
+{
+    struct membo_async_request *req, *tmp;
+
+    spin_lock(&membo_admission_lock);
+    list_for_each_entry_safe(req, tmp, &membo_async_pending, pending) {
+        list_del_init(&req->pending);
+        atomic_dec(&membo_async_waiters);
+        mod_delayed_work(system_unbound_wq, &req->work, 0);
+    }
+    spin_unlock(&membo_admission_lock);
+}
+
+static void membo_async_unpark(struct membo_async_request *req)
+{
+    spin_lock(&membo_admission_lock);
+    if (!list_empty(&req->pending)) {
+        list_del_init(&req->pending);
+        atomic_dec(&membo_async_waiters);
+    }
+    spin_unlock(&membo_admission_lock);
+}
+
+/*
+ * Parks the request until membo_async_kick runs it again, or until its
+ * deadline. Returns false if the request was cancelled meanwhile.
+ */
+static bool membo_async_park(struct membo_async_request *req)
+{
+    spin_lock(&membo_admission_lock);
+    if (req->cancelled) {
+        spin_unlock(&membo_admission_lock);
+        return false;
+    }
+    list_add_tail(&req->pending, &membo_async_pending);
+    atomic_inc(&membo_async_waiters);
+    spin_unlock(&membo_admission_lock);
+
+    if (req->timeout != MAX_SCHEDULE_TIMEOUT)
+        queue_delayed_work(system_unbound_wq, &req->work,
+                           max_t(long, (long)(req->deadline - jiffies), 0));
+
+    /* Ranks released before the request was parked did not kick it */
+    if (membo_async_ranks_available(req)) {
+        membo_async_unpark(req);
+        mod_delayed_work(system_unbound_wq, &req->work, 0);
+    }
+
+    return true;
+}
+
+/*
+ * Reserves the missing ranks of the request one at a time, so that the user
+ * can start using each of them. When no rank is free or lent, the request
+ * is parked rather than keeping a worker asleep: membo_admission_kick runs
+ * it again when ranks are released or lent, and its delayed work at its
+ * deadline.
+ */
+static void membo_async_work_fn(struct work_struct *work)
+{
+    struct membo_async_request *req =
+        container_of(to_delayed_work(work), struct membo_async_request, work);
+
+    membo_async_unpark(req);
+
+    while (req->nr_ranks < req->nr_req_ranks && !READ_ONCE(req->cancelled)) {
+        if (membo_async_take_rank(req)) {
+            req->nr_ranks++;
+            membo_post_event(req, 0, req->ranks[req->nr_ranks - 1]);
+            cond_resched();
+            continue;
+        }
+
+        if (req->timeout != MAX_SCHEDULE_TIMEOUT && time_after_eq(jiffies, req->deadline)) {
+            membo_post_event(req, -ETIMEDOUT, NULL);
+            break;
+        }
+
+        if (membo_async_park(req))
+            return;
+    }
+
+    membo_async_release_victims(req);
+    membo_pool_kick_all();
+    smp_store_release(&req->done, true);
+}
+
+/* Frees the requests of file whose worker is over */
+static void membo_prune_requests(struct dpu_membo_file *file)
+{
+    struct membo_async_request *req, *tmp;
+    LIST_HEAD(done);
+
+    spin_lock(&file->lock);
+    list_for_each_entry_safe(req, tmp, &file->requests, list)
+        if (smp_load_acquire(&req->done)) {
+            list_move(&req->list, &done);
+            file->nr_requests--;
+        }
+    spin_unlock(&file->lock);
+
+    list_for_each_entry_safe(req, tmp, &done, list)
+        kfree(req);
+}
+
+/*
+ * Reserves the free ranks of the request now. If some are missing, the ioctl
+ * returns a request id, and the other ranks are reclaimed in the background
+ * and reported by events, see struct dpu_membo_event.
+ */
+static int dpu_membo_alloc_ranks_async(struct dpu_membo_file *file, unsigned long ptr,
+                                       size_t size)
+{
+    struct dpu_membo_allocation_context allocation_context;
+    struct membo_async_request *req;
+    struct membo_waiter waiter;
+    nodemask_t allowed_nodes;
+    int nr_req_ranks, nr_missing_ranks;
+    int i, ret;
+    bool wait;
+
+    /* Legacy callers only pass the leading fields */
+    memset(&allocation_context, 0, sizeof(allocation_context));
+    if (copy_from_user(&allocation_context, (void *)ptr, size))
+        return -EFAULT;
+
+    nr_req_ranks = allocation_context.nr_req_ranks;
+    if (nr_req_ranks <= 0)
+        return 0;
+    if (nr_req_ranks > DPU_MEMBO_MAX_ALLOC_RANKS ||
+        allocation_context.flags & ~DPU_MEMBO_ALLOC_FLAGS)
+        return -EINVAL;
+
+    req = kzalloc(sizeof(*req), GFP_KERNEL);
+    if (!req)
+        return -ENOMEM;
+
+    req->nr_node_sets = membo_allocation_nodes(&allocation_context, req->nodes);
+    if (req->nr_node_sets < 0) {
+        ret = req->nr_node_sets;
+        kfree(req);
+        return ret;
+    }
+
+    allowed_nodes = req->nodes[0];
+    if (req->nr_node_sets == 2)
+        nodes_or(allowed_nodes, req->nodes[0], req->nodes[1]);
+
+    wait = allocation_context.flags & DPU_MEMBO_ALLOC_WAIT;
+    if (wait) {
+        ret = membo_admission_enter(&waiter, &allocation_context, &allowed_nodes);
+        if (ret) {
+            kfree(req);
+            return ret;
+        }
+    } else if (atomic_read(&membo_admission_depth) ||
+               nr_req_ranks > membo_nr_ranks(MEMBO_RANK_FREE, &allowed_nodes) +
+                              membo_nr_ranks(MEMBO_RANK_LENT, &allowed_nodes)) {
+        kfree(req);
+        return -EBUSY;
+    }
+
+    req->spread = allocation_context.flags & DPU_MEMBO_ALLOC_SPREAD;
+    req->nr_req_ranks = nr_req_ranks;
+    req->file = file;
+    req->timeout = allocation_context.timeout_ms ?
+                   msecs_to_jiffies(allocation_context.timeout_ms) : MAX_SCHEDULE_TIMEOUT;
+    req->deadline = jiffies + req->timeout;
+    INIT_DELAYED_WORK(&req->work, membo_async_work_fn);
+    INIT_LIST_HEAD(&req->pending);
+
+    /* Give the free ranks to the user immediately */
+    for (i = 0; i < req->nr_node_sets; i++)
+        req->nr_ranks = reserve_ranks_for_allocation(req->ranks, req->nr_ranks, nr_req_ranks,
+                                                     &req->nodes[i], req->spread);
+
+    /*
+     * Legacy callers cannot get a request id: as before the events, they
+     * get one reclaimed rank if none is free, and no background request.
+     */
+    if (size < sizeof(allocation_context))
+        nr_missing_ranks = !req->nr_ranks;
+    else
+        nr_missing_ranks = nr_req_ranks - req->nr_ranks;
+
+    /*
+     * Claim the lent ranks the queue counted on before leaving it, so that
+     * the next waiters cannot be granted them: the worker only reclaims them.
+     */
+    for (i = 0; i < req->nr_node_sets && req->nr_victims < nr_missing_ranks; i++)
+        req->nr_victims += claim_reclaim_victims(req->victims + req->nr_victims,
+                                                 nr_missing_ranks - req->nr_victims,
+                                                 &req->nodes[i]);
+
+    if (wait)
+        membo_admission_leave(&waiter);
+
+    if (size < sizeof(allocation_context)) {
+        if (req->nr_victims) {
+            reclaim_ranks(req->victims, 1, MEMBO_RANK_RESERVED);
+            req->ranks[req->nr_ranks++] = req->victims[0];
+            req->nr_victims = 0;
+        }
+        if (!req->nr_ranks) {
+            kfree(req);
+            return -EBUSY;
+        }
+        req->nr_req_ranks = req->nr_ranks;
+    }
+
+    allocation_context.nr_alloc_ranks = req->nr_ranks;
+    for (i = 0; i < req->nr_ranks; i++) {
+        allocation_context.rank_nids[i] = req->ranks[i]->nid;
+        allocation_context.rank_ids[i] = req->ranks[i]->id;
+    }
+
+    allocation_context.request_id = 0;
+    if (req->nr_ranks < req->nr_req_ranks) {
+        membo_prune_requests(file);
+
+        spin_lock(&file->lock);
+        if (file->nr_requests < MEMBO_MAX_ASYNC_REQUESTS) {
+            /* 0 stands for no request */
+            if (!++file->next_request_id)
+                ++file->next_request_id;
+            req->id = file->next_request_id;
+            file->nr_requests++;
+        }
+        spin_unlock(&file->lock);
+
+        if (!req->id) {
+            ret = -EBUSY;
+            goto undo;
+        }
+        allocation_context.request_id = req->id;
+    }
+
+    if (copy_to_user((void *)ptr, &allocation_context, size)) {
+        ret = -EFAULT;
+        goto undo;
+    }
+
+    if (!req->id) {
+        kfree(req);
+        membo_pool_kick_all();
+        return 0;
+    }
+
+    spin_lock(&file->lock);
+    list_add_tail(&req->list, &file->requests);
+    spin_unlock(&file->lock);
+
+    queue_delayed_work(system_unbound_wq, &req->work, 0);
+    return 0;
+
+undo:
+    if (req->id) {
+        spin_lock(&file->lock);
+        file->nr_requests--;
+        spin_unlock(&file->lock);
+    }
+    membo_async_release_victims(req);
+    unreserve_ranks(req->ranks, req->nr_ranks);
+    kfree(req);
+    return ret;
+}
+
+/* Counters are atomic, a usage query does not take any lock */
+static int dpu_membo_get_usage(unsigned long ptr)
+{
+    struct dpu_membo_usage_context usage_context;
+
+    usage_context.nr_used_ranks = membo_nr_ranks(MEMBO_RANK_USED, &node_online_map);
+
+    if (copy_to_user((void *)ptr, &usage_context, sizeof(usage_context)))
+        return -EFAULT;
+
+    return 0;
+}
+
+static int dpu_membo_set_threshold(unsigned long ptr)
+{
+    struct dpu_membo_dynamic_reservation_context reservation_context;
+    int thresholds[2];
+    int node;
+
+    if (copy_from_user(&reservation_context, (void *)ptr, sizeof(reservation_context)))
+        return -EFAULT;
+
+    thresholds[0] = reservation_context.node0_threshold;
+    thresholds[1] = reservation_context.node1_threshold;
+    for (node = 0; node < ARRAY_SIZE(thresholds); node++)
+        if (node_online(node) && membo_context_list[node])
+            atomic_set(&membo_context_list[node]->nr_reserved_ranks, thresholds[node]);
+
+    for_each_online_node(node) {
+        pg_data_t *pgdat = NODE_DATA(node);
+        int nr_total_ranks = atomic_read(&membo_context_list[node]->nr_total_ranks);
+        int nr_reserved_ranks = atomic_read(&membo_context_list[node]->nr_reserved_ranks);
+        int nr_ltb_ranks = atomic_read(&membo_context_list[node]->nr_ltb_ranks);
+
+        if (nr_ltb_ranks > nr_total_ranks - nr_reserved_ranks) {
+            int nr_excess_ranks = nr_ltb_ranks - (nr_total_ranks - nr_reserved_ranks);
+            nodemask_t nodes = nodemask_of_node(node);
+            struct dpu_rank_t **victims;
+            int nr_victims;
+
+            victims = kcalloc(nr_excess_ranks, sizeof(*victims), GFP_KERNEL);
+            if (!victims)
+                return -ENOMEM;
+
+            nr_victims = claim_reclaim_victims(victims, nr_excess_ranks, &nodes);
+            reclaim_ranks(victims, nr_victims, MEMBO_RANK_FREE);
+            kfree(victims);
+        }
+
+        atomic_set(&pgdat->membo_disabled, 0);
+    }
+
+    return 0;
+}
+
+/*
+ * Heat of a lent section: how many of MEMBO_HEAT_SAMPLES pages spread over
+ * the section are on an LRU list and were referenced recently.
+ */
+static unsigned int sample_section_heat(struct dpu_rank_t *rank, int section_id)
+{
+    unsigned long pfn = page_to_pfn(virt_to_page(rank->region->base)) +
+                        section_id * PAGES_PER_SECTION;
+    unsigned int i, heat = 0;
+
+    for (i = 0; i < MEMBO_HEAT_SAMPLES; i++) {
+        struct page *page = pfn_to_page(pfn + i * (PAGES_PER_SECTION / MEMBO_HEAT_SAMPLES));
+
+        if (PageLRU(page) && (PageActive(page) || PageReferenced(page)))
+            heat++;
+    }
+
+    return heat;
+}
+
+/*
+ * Heat sampler: while the node lends ranks, refreshes the heat estimate of
+ * each lent section every MEMBO_HEAT_INTERVAL, as the mean of the previous
+ * estimate and of a new sample.
+ */
+static void membo_heat_work_fn(struct work_struct *work)
+{
+    membo_context_t *ctx = container_of(to_delayed_work(work), membo_context_t, heat_work);
+    struct dpu_rank_t *rank;
+    unsigned long section_id;
+    bool lending;
+
+    membo_lock(ctx->nid);
+    list_for_each_entry (rank, &ctx->ltb_rank_list, state_list)
+        for_each_set_bit (section_id, rank->ltb_sections, SECTIONS_PER_DPU_RANK)
+            rank->ltb_heat[section_id] =
+                (rank->ltb_heat[section_id] + sample_section_heat(rank, section_id)) / 2;
+    lending = !list_empty(&ctx->ltb_rank_list);
+    membo_unlock(ctx->nid);
+
+    if (lending)
+        queue_delayed_work(system_unbound_wq, &ctx->heat_work, MEMBO_HEAT_INTERVAL);
+}
+
+/*
+ * Must be called with the membo lock of the node held. Returns the lent
+ * rank holding the coldest section of the node, preferring the rank with
+ * the fewest lent sections to free ranks sooner. When borrowing is striped,
+ * takes the coldest section of the most lent rank instead, to keep the
+ * stripe balanced.
+ */
+static struct dpu_rank_t *pick_coldest_section(int nid, unsigned long *coldest_section,
+                                               bool striped, unsigned long min_residency)
+{
+    struct dpu_rank_t *rank_iterator, *coldest_rank = NULL;
+    unsigned long section_id;
+
+    list_for_each_entry (rank_iterator, &membo_context_list[nid]->ltb_rank_list, state_list)
+        for_each_set_bit (section_id, rank_iterator->ltb_sections, SECTIONS_PER_DPU_RANK) {
+            /* Lent too recently */
+            if (time_before(jiffies, rank_iterator->ltb_jiffies[section_id] + min_residency))
+                continue;
+
+            if (coldest_rank) {
+                uint8_t heat = rank_iterator->ltb_heat[section_id];
+                uint8_t coldest_heat = coldest_rank->ltb_heat[*coldest_section];
+                int nr_sections = atomic_read(&rank_iterator->nr_ltb_sections);
+                int coldest_nr_sections = atomic_read(&coldest_rank->nr_ltb_sections);
+
+                if (striped && nr_sections != coldest_nr_sections) {
+                    if (nr_sections < coldest_nr_sections)
+                        continue;
+                } else if (heat > coldest_heat ||
+                           (heat == coldest_heat && nr_sections >= coldest_nr_sections)) {
+                    continue;
+                }
+            }
+
+            coldest_rank = rank_iterator;
+            *coldest_section = section_id;
+        }
+
+    return coldest_rank;
+}
+
+static int dpu_membo_set_watermarks(unsigned long ptr)
+{
+    struct dpu_membo_watermark_context wmark_context;
+    membo_context_t *ctx;
+
+    if (copy_from_user(&wmark_context, (void *)ptr, sizeof(wmark_context)))
+        return -EFAULT;
+
+    if (wmark_context.nid < 0 || wmark_context.nid >= MAX_NUMNODES ||
+        !node_online(wmark_context.nid) || !membo_context_list[wmark_context.nid])
+        return -EINVAL;
+
+    if (wmark_context.low_wmark_mb > wmark_context.high_wmark_mb)
+        return -EINVAL;
+
+    ctx = membo_context_list[wmark_context.nid];
+
+    membo_lock(wmark_context.nid);
+    ctx->borrow_low_wmark = wmark_context.low_wmark_mb << (20 - PAGE_SHIFT);
+    ctx->borrow_high_wmark = wmark_context.high_wmark_mb << (20 - PAGE_SHIFT);
+    membo_unlock(wmark_context.nid);
+
+    return 0;
+}
+
+static int dpu_membo_xfer_ranks(unsigned long ptr, bool write)
+{
+    struct dpu_membo_xfer_context xfer_context;
+
+    if (copy_from_user(&xfer_context, (void *)ptr, sizeof(xfer_context)))
+        return -EFAULT;
+
+    return dpu_rank_batch_xfer(&xfer_context, write);
+}
+
+static int dpu_membo_open(struct inode *inode, struct file *filp)
+{
+    struct dpu_membo_fs *fs =
+        container_of(inode->i_cdev, struct dpu_membo_fs, cdev);
+    struct dpu_membo_file *file;
+
+    file = kzalloc(sizeof(*file), GFP_KERNEL);
+    if (!file)
+        return -ENOMEM;
+
+    file->fs = fs;
+    spin_lock_init(&file->lock);
+    INIT_LIST_HEAD(&file->events);
+    init_waitqueue_head(&file->wait);
+    INIT_LIST_HEAD(&file->requests);
+    filp->private_data = file;
+
+    membo_fs_lock();
+    if (fs->is_opened) {
+        membo_fs_unlock();
+        return 0;
+    }
+
+    fs->is_opened = true;
+    membo_fs_unlock();
+
+    return 0;
+}
+
+/*
+ * The pending async allocations of the file are stopped. The ranks they
+ * already reserved stay reserved, as for the synchronous allocations.
+ */
+static int dpu_membo_release(struct inode *inode, struct file *filp)
+{
+    struct dpu_membo_file *file = filp->private_data;
+    struct membo_async_request *req, *tmp_req;
+    struct membo_event_entry *entry, *tmp_entry;
+
+    if (!file)
+        return 0;
+
+    list_for_each_entry(req, &file->requests, list) {
+        spin_lock(&membo_admission_lock);
+        WRITE_ONCE(req->cancelled, true);
+        spin_unlock(&membo_admission_lock);
+        membo_async_unpark(req);
+    }
+
+    list_for_each_entry_safe(req, tmp_req, &file->requests, list) {
+        cancel_delayed_work_sync(&req->work);
+        /* The worker may not have run at all */
+        membo_async_release_victims(req);
+        kfree(req);
+    }
+
+    list_for_each_entry_safe(entry, tmp_entry, &file->events, list)
+        kfree(entry);
+
+    membo_fs_lock();
+    file->fs->is_opened = false;
+    membo_fs_unlock();
+
+    kfree(file);
+    return 0;
+}
+
+static bool membo_has_events(struct dpu_membo_file *file)
+{
+    bool has_events;
+
+    spin_lock(&file->lock);
+    has_events = !list_empty(&file->events);
+    spin_unlock(&file->lock);
+
+    return has_events;
+}
+
+/* Returns as many whole struct dpu_membo_event as count can hold */
+static ssize_t dpu_membo_read(struct file *filp, char __user *buf, size_t count,
+                              loff_t *ppos)
+{
+    struct dpu_membo_file *file = filp->private_data;
+    struct membo_event_entry *entry;
+    size_t copied = 0;
+    int ret;
+
+    if (count < sizeof(entry->event))
+        return -EINVAL;
+
+    if (!(filp->f_flags & O_NONBLOCK)) {
+        ret = wait_event_interruptible(file->wait, membo_has_events(file));
+        if (ret)
+            return ret;
+    }
+
+    while (copied + sizeof(entry->event) <= count) {
+        spin_lock(&file->lock);
+        entry = list_first_entry_or_null(&file->events, struct membo_event_entry, list);
+        if (entry)
+            list_del(&entry->list);
+        spin_unlock(&file->lock);
+
+        if (!entry)
+            break;
+
+        if (copy_to_user(buf + copied, &entry->event, sizeof(entry->event))) {
+            spin_lock(&file->lock);
+            list_add(&entry->list, &file->events);
+            spin_unlock(&file->lock);
+            return copied ? copied : -EFAULT;
+        }
+
+        copied += sizeof(entry->event);
+        kfree(entry);
+    }
+
+    return copied ? copied : -EAGAIN;
+}
+
+static unsigned int dpu_membo_poll(struct file *filp, poll_table *wait)
+{
+    struct dpu_membo_file *file = filp->private_data;
+
+    poll_wait(filp, &file->wait, wait);
+
+    if (membo_has_events(file))
+        return POLLIN | POLLRDNORM;
+
+    return 0;
+}
+
+/* Read-only mapping of the status page, see struct dpu_membo_status */
+static int dpu_membo_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+
+    if (vma->vm_pgoff || vma->vm_end - vma->vm_start > PAGE_SIZE)
+        return -EINVAL;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+    return remap_vmalloc_range(vma, membo_status, 0);
+}
+
+static long dpu_membo_ioctl(struct file *filp, unsigned int cmd,
+        unsigned long arg)
+{
+    struct dpu_membo_file *file = filp->private_data;
+    int ret = 0;
+
+    if (!file)
+        return 0;
+
+    switch (cmd) {
+    case DPU_MEMBO_IOCTL_ALLOC_RANKS_DIRECT:
+        ret = dpu_membo_alloc_ranks_direct(arg, sizeof(struct dpu_membo_legacy_allocation_context));
+        break;
+    case DPU_MEMBO_IOCTL_ALLOC_RANKS_ASYNC:
+        ret = dpu_membo_alloc_ranks_async(file, arg,
+                                          sizeof(struct dpu_membo_legacy_allocation_context));
+        break;
+    case DPU_MEMBO_IOCTL_ALLOC_RANKS_DIRECT_EXT:
+        ret = dpu_membo_alloc_ranks_direct(arg, sizeof(struct dpu_membo_allocation_context));
+        break;
+    case DPU_MEMBO_IOCTL_ALLOC_RANKS_ASYNC_EXT:
+        ret = dpu_membo_alloc_ranks_async(file, arg, sizeof(struct dpu_membo_allocation_context));
+        break;
+    case DPU_MEMBO_IOCTL_SET_THRESHOLD:
+        ret = dpu_membo_set_threshold(arg);
+        break;
+    case DPU_MEMBO_IOCTL_GET_USAGE:
+        ret = dpu_membo_get_usage(arg);
+        break;
+    case DPU_MEMBO_IOCTL_WRITE_TO_RANKS:
+        ret = dpu_membo_xfer_ranks(arg, true);
+        break;
+    case DPU_MEMBO_IOCTL_READ_FROM_RANKS:
+        ret = dpu_membo_xfer_ranks(arg, false);
+        break;
+    case DPU_MEMBO_IOCTL_SET_WATERMARKS:
+        ret = dpu_membo_set_watermarks(arg);
+        break;
+    default:
+        break;
+    }
+
+    return ret;
+}
+
+static struct file_operations dpu_membo_fops = {
+    .owner = THIS_MODULE,
+    .open = dpu_membo_open,
+    .release = dpu_membo_release,
+    .read = dpu_membo_read,
+    .poll = dpu_membo_poll,
+    .mmap = dpu_membo_mmap,
+    .unlocked_ioctl = dpu_membo_ioctl,
+};
+
+extern int (*membo_request_mram_borrowing)(int nid);
+extern int (*membo_request_mram_reclamation)(int nid);
+
+void membo_lock(int nid)
+{
+    mutex_lock(&(membo_context_list[nid]->mutex));
+}
+
+void membo_unlock(int nid)
+{
+    mutex_unlock(&(membo_context_list[nid]->mutex));
+}
+
+void membo_fs_lock(void)
+{
+    mutex_lock(&membo_fs.mutex);
+}
+
+void membo_fs_unlock(void)
+{
+    mutex_unlock(&membo_fs.mutex);
+}
+
+static ssize_t pool_min_free_ranks_show(struct device *dev,
+                                        struct device_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", READ_ONCE(membo_pool_min_free_ranks));
+}
+
+static ssize_t pool_min_free_ranks_store(struct device *dev,
+                                         struct device_attribute *attr,
+                                         const char *buf, size_t len)
+{
+    unsigned int tmp;
+    int ret;
+
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+
+    ret = kstrtouint(buf, 10, &tmp);
+    if (ret)
+        return ret;
+
+    WRITE_ONCE(membo_pool_min_free_ranks, tmp);
+    membo_pool_kick_all();
+
+    return len;
+}
+
+static ssize_t pool_min_free_mb_show(struct device *dev,
+                                     struct device_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lu\n", READ_ONCE(membo_pool_min_free_pages) >> (20 - PAGE_SHIFT));
+}
+
+static ssize_t pool_min_free_mb_store(struct device *dev,
+                                      struct device_attribute *attr,
+                                      const char *buf, size_t len)
+{
+    unsigned long tmp;
+    int ret;
+
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+
+    ret = kstrtoul(buf, 10, &tmp);
+    if (ret)
+        return ret;
+
+    WRITE_ONCE(membo_pool_min_free_pages, tmp << (20 - PAGE_SHIFT));
+
+    return len;
+}
+
+/* Ranks of each node that cannot be lent, set by DPU_MEMBO_IOCTL_SET_THRESHOLD */
+static ssize_t threshold_show(struct device *dev,
+                              struct device_attribute *attr, char *buf)
+{
+    ssize_t count = 0;
+    int node;
+
+    for_each_online_node(node)
+        count += sprintf(buf + count, "%d ",
+                         atomic_read(&membo_context_list[node]->nr_reserved_ranks));
+
+    if (count)
+        buf[count - 1] = '\n';
+
+    return count;
+}
+
+static ssize_t hysteresis_mb_show(struct device *dev,
+                                  struct device_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lu\n", READ_ONCE(membo_hysteresis_pages) >> (20 - PAGE_SHIFT));
+}
+
+static ssize_t hysteresis_mb_store(struct device *dev,
+                                   struct device_attribute *attr,
+                                   const char *buf, size_t len)
+{
+    unsigned long tmp;
+    int ret;
+
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+
+    ret = kstrtoul(buf, 10, &tmp);
+    if (ret)
+        return ret;
+
+    WRITE_ONCE(membo_hysteresis_pages, tmp << (20 - PAGE_SHIFT));
+
+    return len;
+}
+
+static ssize_t min_residency_ms_show(struct device *dev,
+                                     struct device_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", jiffies_to_msecs(READ_ONCE(membo_min_residency)));
+}
+
+static ssize_t min_residency_ms_store(struct device *dev,
+                                      struct device_attribute *attr,
+                                      const char *buf, size_t len)
+{
+    unsigned int tmp;
+    int ret;
+
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+
+    ret = kstrtouint(buf, 10, &tmp);
+    if (ret)
+        return ret;
+
+    WRITE_ONCE(membo_min_residency, msecs_to_jiffies(tmp));
+
+    return len;
 }
 
-static int dpu_membo_get_usage(unsigned long ptr)
+static ssize_t rate_limit_show(struct device *dev,
+                               struct device_attribute *attr, char *buf)
 {
-    struct dpu_membo_usage_context usage_context;
-    int node;
-    int nr_used_ranks = 0;
+    return sprintf(buf, "%u\n", READ_ONCE(membo_rate_limit));
+}
 
-    for_each_online_node(node)
-        membo_lock(node);
+static ssize_t rate_limit_store(struct device *dev,
+                                struct device_attribute *attr,
+                                const char *buf, size_t len)
+{
+    unsigned int tmp;
+    int ret;
 
-    for_each_online_node(node)
-        nr_used_ranks += atomic_read(&membo_context_list[node]->nr_used_ranks);
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
 
-    usage_context.nr_used_ranks = nr_used_ranks;
+    ret = kstrtouint(buf, 10, &tmp);
+    if (ret)
+        return ret;
 
-    if (copy_to_user((void *)ptr, &usage_context, sizeof(usage_context))) {
-        for_each_online_node(node)
-            membo_unlock(node);
-        return -EFAULT;
-    }
+    WRITE_ONCE(membo_rate_limit, tmp);
 
-    for_each_online_node(node)
-        membo_unlock(node);
+    return len;
+}
 
-    return 0;
+static ssize_t compact_budget_ms_show(struct device *dev,
+                                      struct device_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", READ_ONCE(membo_compact_budget_ms));
 }
 
-static int dpu_membo_set_threshold(unsigned long ptr)
+static ssize_t compact_budget_ms_store(struct device *dev,
+                                       struct device_attribute *attr,
+                                       const char *buf, size_t len)
 {
-    struct dpu_membo_dynamic_reservation_context reservation_context;
+    unsigned int tmp;
     int node;
+    int ret;
 
-    if (copy_from_user(&reservation_context, (void *)ptr, sizeof(reservation_context)))
-        return -EFAULT;
-
-    for_each_online_node(node)
-        membo_lock(node);
-
-    atomic_set(&membo_context_list[0]->nr_reserved_ranks, reservation_context.node0_threshold);
-    atomic_set(&membo_context_list[1]->nr_reserved_ranks, reservation_context.node1_threshold);
-
-    for_each_online_node(node) {
-        pg_data_t *pgdat = NODE_DATA(node);
-        int nr_total_ranks = atomic_read(&membo_context_list[node]->nr_total_ranks);
-        int nr_reserved_ranks = atomic_read(&membo_context_list[node]->nr_reserved_ranks);
-        int nr_ltb_ranks = atomic_read(&membo_context_list[node]->nr_ltb_ranks);
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
 
-        if (nr_ltb_ranks > nr_total_ranks - nr_reserved_ranks) {
-            direct_reclaim_ranks_node(nr_ltb_ranks - (nr_total_ranks - nr_reserved_ranks), node);
-        }
+    ret = kstrtouint(buf, 10, &tmp);
+    if (ret)
+        return ret;
 
-        atomic_set(&pgdat->membo_disabled, 0);
+    if (tmp > jiffies_to_msecs(MEMBO_COMPACT_INTERVAL)) {
+        dev_err(dev, "compact_budget_ms: at most %u ms\n",
+                jiffies_to_msecs(MEMBO_COMPACT_INTERVAL));
+        return -EINVAL;
     }
 
-    for_each_online_node(node)
-        membo_unlock(node);
+    WRITE_ONCE(membo_compact_budget_ms, tmp);
+    if (tmp)
+        for_each_online_node(node)
+            mod_delayed_work(system_unbound_wq, &membo_context_list[node]->compact_work, 0);
 
-    return 0;
+    return len;
 }
 
-static long dpu_membo_ioctl(struct file *filp, unsigned int cmd,
-        unsigned long arg)
+static ssize_t borrow_stripe_show(struct device *dev,
+                                  struct device_attribute *attr, char *buf)
 {
-    struct dpu_membo_fs *fs = filp->private_data;
-    int ret = 0;
-
-    if (!fs)
-        return 0;
+    return sprintf(buf, "%u\n", READ_ONCE(membo_borrow_stripe));
+}
 
-    switch (cmd) {
-    case DPU_MEMBO_IOCTL_ALLOC_RANKS_DIRECT:
-        ret = dpu_membo_alloc_ranks_direct(arg);
-        break;
-    case DPU_MEMBO_IOCTL_ALLOC_RANKS_ASYNC:
-        ret = dpu_membo_alloc_ranks_async(arg);
-        break;
-    case DPU_MEMBO_IOCTL_SET_THRESHOLD:
-        ret = dpu_membo_set_threshold(arg);
-        break;
-    case DPU_MEMBO_IOCTL_GET_USAGE:
-        ret = dpu_membo_get_usage(arg);
-        break;
-    default:
-        break;
-    }
+static ssize_t borrow_stripe_store(struct device *dev,
+                                   struct device_attribute *attr,
+                                   const char *buf, size_t len)
+{
+    unsigned int tmp;
+    int ret;
 
-    return ret;
-}
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
 
-static struct file_operations dpu_membo_fops = {
-    .owner = THIS_MODULE,
-    .open = dpu_membo_open,
-    .release = dpu_membo_release,
-    .unlocked_ioctl = dpu_membo_ioctl,
-};
+    ret = kstrtouint(buf, 10, &tmp);
+    if (ret)
+        return ret;
 
-extern int (*membo_request_mram_borrowing)(int nid);
-extern int (*membo_request_mram_reclamation)(int nid);
+    WRITE_ONCE(membo_borrow_stripe, tmp);
 
-void membo_lock(int nid)
-{
-    mutex_lock(&(membo_context_list[nid]->mutex));
+    return len;
 }
 
-void membo_unlock(int nid)
+/* One line per node: sections borrowed and reclaimed by the kernel requests */
+static ssize_t stats_show(struct device *dev,
+                          struct device_attribute *attr, char *buf)
 {
-    mutex_unlock(&(membo_context_list[nid]->mutex));
-}
+    ssize_t count = 0;
+    int node;
 
-void membo_fs_lock(void)
-{
-    mutex_lock(&membo_fs.mutex);
+    for_each_online_node(node) {
+        struct membo_stats *stats = &membo_context_list[node]->stats;
+
+        count += sprintf(buf + count,
+                         "node%d borrowed %lu reclaimed %lu flaps %lu deferred %lu throttled %lu "
+                         "compacted %lu compacted_ranks %lu\n",
+                         node, READ_ONCE(stats->nr_borrowed), READ_ONCE(stats->nr_reclaimed),
+                         READ_ONCE(stats->nr_flaps), READ_ONCE(stats->nr_deferred),
+                         READ_ONCE(stats->nr_throttled), READ_ONCE(stats->nr_compacted),
+                         READ_ONCE(stats->nr_compacted_ranks));
+    }
+
+    return count;
 }
 
-void membo_fs_unlock(void)
+static ssize_t admission_show(struct device *dev,
+                              struct device_attribute *attr, char *buf)
 {
-    mutex_unlock(&membo_fs.mutex);
+    struct membo_admission_stats stats;
+
+    spin_lock(&membo_admission_lock);
+    stats = membo_admission_stats;
+    spin_unlock(&membo_admission_lock);
+
+    return sprintf(buf,
+                   "depth %d queued %lu granted %lu timeouts %lu interrupted %lu "
+                   "total_wait_ms %lu max_wait_ms %lu\n",
+                   atomic_read(&membo_admission_depth), stats.nr_queued, stats.nr_granted,
+                   stats.nr_timeouts, stats.nr_interrupted, stats.total_wait_ms,
+                   stats.max_wait_ms);
 }
 
+static DEVICE_ATTR_RW(pool_min_free_ranks);
+static DEVICE_ATTR_RW(pool_min_free_mb);
+static DEVICE_ATTR_RO(threshold);
+static DEVICE_ATTR_RW(hysteresis_mb);
+static DEVICE_ATTR_RW(min_residency_ms);
+static DEVICE_ATTR_RW(rate_limit);
+static DEVICE_ATTR_RW(compact_budget_ms);
+static DEVICE_ATTR_RW(borrow_stripe);
+static DEVICE_ATTR_RO(stats);
+static DEVICE_ATTR_RO(admission);
+
+static struct attribute *dpu_membo_attrs[] = {
+    &dev_attr_pool_min_free_ranks.attr,
+    &dev_attr_pool_min_free_mb.attr,
+    &dev_attr_threshold.attr,
+    &dev_attr_hysteresis_mb.attr,
+    &dev_attr_min_residency_ms.attr,
+    &dev_attr_rate_limit.attr,
+    &dev_attr_compact_budget_ms.attr,
+    &dev_attr_borrow_stripe.attr,
+    &dev_attr_stats.attr,
+    &dev_attr_admission.attr,
+    NULL,
+};
+
+static struct attribute_group dpu_membo_attrs_group = {
+    .attrs = dpu_membo_attrs,
+};
+
+static const struct attribute_group *dpu_membo_attrs_groups[] = {
+    &dpu_membo_attrs_group,
+    NULL,
+};
+
 static void dpu_membo_dev_release(struct device *dev)
 {
 
@@ -353,11 +1915,27 @@ static void dpu_membo_dev_release(struct device *dev)
 
 int dpu_membo_create_device(void)
 {
-    int ret;
+    struct dpu_membo_status *status_page;
+    int node, ret;
+
+    BUILD_BUG_ON(sizeof(struct dpu_membo_status) > PAGE_SIZE);
+
+    status_page = vmalloc_user(PAGE_SIZE);
+    if (!status_page)
+        return -ENOMEM;
+    status_page->nr_nodes = min_t(unsigned int, nr_node_ids, DPU_MEMBO_STATUS_MAX_NODES);
+    WRITE_ONCE(membo_status, status_page);
+
+    /* Publish the ranks the nodes already have */
+    for_each_online_node(node) {
+        membo_lock(node);
+        membo_status_update(membo_context_list[node]);
+        membo_unlock(node);
+    }
 
     ret = alloc_chrdev_region(&membo_fs.dev.devt, 0, 1, DPU_MEMBO_NAME);
     if (ret)
-        return ret;
+        goto free_status;
 
     cdev_init(&membo_fs.cdev, &dpu_membo_fops);
     membo_fs.cdev.owner = THIS_MODULE;
@@ -366,6 +1944,7 @@ int dpu_membo_create_device(void)
 
     membo_fs.dev.class = dpu_membo_class;
     membo_fs.dev.release = dpu_membo_dev_release;
+    membo_fs.dev.groups = dpu_membo_attrs_groups;
 
     dev_set_drvdata(&membo_fs.dev, &membo_fs);
     dev_set_name(&membo_fs.dev, DPU_MEMBO_NAME);
@@ -376,19 +1955,42 @@ int dpu_membo_create_device(void)
 
     mutex_init(&membo_fs.mutex);
     membo_fs.is_opened = false;
+    WRITE_ONCE(membo_works_enabled, true);
 
     return 0;
 out:
     put_device(&membo_fs.dev);
     unregister_chrdev_region(membo_fs.dev.devt, 1);
+free_status:
+    WRITE_ONCE(membo_status, NULL);
+    vfree(status_page);
     return ret;
 }
 
 void dpu_membo_release_device(void)
 {
+    struct dpu_membo_status *status_page;
+    int node;
+
+    WRITE_ONCE(membo_pool_min_free_ranks, 0);
+    WRITE_ONCE(membo_compact_budget_ms, 0);
+    if (membo_works_enabled) {
+        WRITE_ONCE(membo_works_enabled, false);
+        for_each_online_node(node) {
+            cancel_delayed_work_sync(&membo_context_list[node]->pool_work);
+            cancel_delayed_work_sync(&membo_context_list[node]->heat_work);
+            cancel_delayed_work_sync(&membo_context_list[node]->compact_work);
+        }
+    }
+
     cdev_device_del(&membo_fs.cdev, &membo_fs.dev);
     put_device(&membo_fs.dev);
     unregister_chrdev_region(membo_fs.dev.devt, 1);
+
+    /* The pages stay mapped in the processes that still map them */
+    status_page = membo_status;
+    WRITE_ONCE(membo_status, NULL);
+    vfree(status_page);
 }
 
 static void init_membo_api(void)
@@ -397,6 +1999,8 @@ static void init_membo_api(void)
     membo_request_mram_reclamation = request_mram_reclamation;
 }
 
+static void membo_compact_work_fn(struct work_struct *work);
+
 int init_membo_context(int nid)
 {
     membo_context_list[nid] = kzalloc(sizeof(membo_context_t), GFP_KERNEL);
@@ -407,15 +2011,28 @@ int init_membo_context(int nid)
 
     membo_lock(nid);
     INIT_LIST_HEAD(&membo_context_list[nid]->rank_list);
+    INIT_LIST_HEAD(&membo_context_list[nid]->free_rank_list);
+    INIT_LIST_HEAD(&membo_context_list[nid]->reserved_rank_list);
+    INIT_LIST_HEAD(&membo_context_list[nid]->used_rank_list);
     INIT_LIST_HEAD(&membo_context_list[nid]->ltb_rank_list);
+    INIT_LIST_HEAD(&membo_context_list[nid]->reclaiming_rank_list);
 
     membo_context_list[nid]->ltb_index = NULL;
     membo_context_list[nid]->nid = nid;
+    INIT_DELAYED_WORK(&membo_context_list[nid]->pool_work, membo_pool_work_fn);
+    INIT_DELAYED_WORK(&membo_context_list[nid]->heat_work, membo_heat_work_fn);
+    INIT_DELAYED_WORK(&membo_context_list[nid]->compact_work, membo_compact_work_fn);
+    membo_context_list[nid]->last_borrow_jiffies = jiffies - MEMBO_FLAP_WINDOW;
+    membo_context_list[nid]->last_reclaim_jiffies = jiffies - MEMBO_FLAP_WINDOW;
+    membo_context_list[nid]->rate_window_start = jiffies;
 
     atomic_set(&membo_context_list[nid]->nr_free_ranks, 0);
+    atomic_set(&membo_context_list[nid]->nr_pending_ranks, 0);
     atomic_set(&membo_context_list[nid]->nr_ltb_ranks, 0);
+    atomic_set(&membo_context_list[nid]->nr_reclaiming_ranks, 0);
     atomic_set(&membo_context_list[nid]->nr_used_ranks, 0);
     atomic_set(&membo_context_list[nid]->nr_reserved_ranks, 0);
+    membo_context_list[nid]->nr_ltb_sections = 0;
     atomic_set(&NODE_DATA(nid)->membo_is_direct_reclaim_activated, 0);
 
     membo_unlock(nid);
@@ -453,50 +2070,48 @@ static uint32_t expand_one_section(struct dpu_rank_t *rank, int section_id)
     struct memory_block *mem = container_of(rank->dev.parent, struct memory_block, dev);
     struct zone *zone = page_zone(page);
 
-    borrow_mram_pages(page_to_pfn(page) + section_id * PAGES_PER_SECTION, PAGES_PER_SECTION, zone, mem->group);
-    return 0;
+    if (borrow_mram_pages(page_to_pfn(page) + section_id * PAGES_PER_SECTION, PAGES_PER_SECTION,
+                          zone, mem->group))
+        return DPU_ERR_DRIVER;
+    return DPU_OK;
 }
 
-static uint32_t reclaim_one_section(struct dpu_rank_t *rank, int section_id)
+/* Must be called with the membo lock of the node held */
+static uint32_t membo_lend_rank(struct dpu_rank_t *free_rank, int nid)
 {
-    struct page *page = virt_to_page(rank->region->base);
-    struct memory_block *mem = container_of(rank->dev.parent, struct memory_block, dev);
+    pg_data_t *pgdat = NODE_DATA(nid);
 
-    reclaim_mram_pages(page_to_pfn(page) + section_id * PAGES_PER_SECTION, PAGES_PER_SECTION, mem->group, &rank->region->dpu_dax_dev.pgmap);
-    return 0;
+    if (dpu_rank_get(free_rank) != DPU_OK)
+        return DPU_ERR_DRIVER;
+
+    /* Move the rank from free_rank_list to ltb_rank_list */
+    membo_rank_set_state(free_rank, MEMBO_RANK_LENT);
+    if (atomic_read(&membo_context_list[nid]->nr_ltb_ranks) == 1) {
+        wakeup_membo_reclaimer(nid);
+        if (READ_ONCE(membo_works_enabled))
+            mod_delayed_work(system_unbound_wq, &membo_context_list[nid]->heat_work, 0);
+    }
+    atomic_inc(&pgdat->membo_nr_ranks);
+
+    /* Update ltb allocation index */
+    membo_context_list[nid]->ltb_index = free_rank;
+    return DPU_OK;
 }
 
 uint32_t dpu_membo_rank_alloc(struct dpu_rank_t **rank, int nid)
 {
-    struct dpu_rank_t *rank_iterator;
-    pg_data_t *pgdat = NODE_DATA(nid);
+    struct dpu_rank_t *free_rank;
 
     *rank = NULL;
 
-    list_for_each_entry (rank_iterator, &membo_context_list[nid]->rank_list, list) {
-        if (rank_iterator->is_reserved)
-            continue;
-        if (dpu_rank_get(rank_iterator) == DPU_OK) {
-            *rank = rank_iterator;
-
-            /* Move the rank from rank_list to ltb_rank_list */
-            list_del(&rank_iterator->list);
-            list_add_tail(&rank_iterator->list, &membo_context_list[nid]->ltb_rank_list);
-
-            /* Update counters */
-            atomic_dec(&membo_context_list[nid]->nr_free_ranks);
-            if (atomic_inc_return(&membo_context_list[nid]->nr_ltb_ranks) == 1)
-                wakeup_membo_reclaimer(nid);
-            atomic_inc(&pgdat->membo_nr_ranks);
-
-            /* Update ltb allocation index */
-            membo_context_list[nid]->ltb_index = rank_iterator;
-            return DPU_OK;
-        }
-    }
+    free_rank = membo_first_rank(nid, MEMBO_RANK_FREE);
 
     /* We can not find a free rank for the MEMBO allocation */
-    return DPU_ERR_DRIVER;
+    if (!free_rank || membo_lend_rank(free_rank, nid) != DPU_OK)
+        return DPU_ERR_DRIVER;
+
+    *rank = free_rank;
+    return DPU_OK;
 }
 
 uint32_t dpu_membo_rank_free(struct dpu_rank_t **rank, int nid)
@@ -506,70 +2121,375 @@ uint32_t dpu_membo_rank_free(struct dpu_rank_t **rank, int nid)
 
     target_rank = *rank;
 
+    /* Moves the rank back to free_rank_list */
     dpu_rank_put(target_rank);
 
-    if (atomic_dec_return(&membo_context_list[nid]->nr_ltb_ranks) == 0)
-        membo_context_list[nid]->ltb_index = NULL;
-    else if (membo_context_list[nid]->ltb_index == target_rank)
-        membo_context_list[nid]->ltb_index = list_entry(target_rank->list.prev, typeof(*target_rank), list);
-
-    list_del(&target_rank->list);
-    list_add_tail(&target_rank->list, &membo_context_list[nid]->rank_list);
+    membo_update_ltb_index(nid);
 
     atomic_dec(&pgdat->membo_nr_ranks);
 
     return DPU_OK;
 }
 
-int request_mram_borrowing(int nid)
+/* Must be called with the membo lock of the rank node held */
+static int lend_one_section(struct dpu_rank_t *rank)
+{
+    unsigned long section_id;
+
+    section_id = find_first_zero_bit(rank->ltb_sections, SECTIONS_PER_DPU_RANK);
+    if (expand_one_section(rank, section_id) != DPU_OK)
+        return -EBUSY;
+    set_bit(section_id, rank->ltb_sections);
+    rank->ltb_heat[section_id] = 0;
+    rank->ltb_jiffies[section_id] = jiffies;
+    membo_add_rank_sections(rank, 1);
+    return 0;
+}
+
+/* Must be called with the membo lock of the node held */
+static bool membo_can_lend_rank(int nid)
+{
+    membo_context_t *ctx = membo_context_list[nid];
+
+    if (atomic_read(&ctx->nr_ltb_ranks) + atomic_read(&ctx->nr_reclaiming_ranks) >=
+        atomic_read(&ctx->nr_total_ranks) - atomic_read(&ctx->nr_reserved_ranks))
+        return false;
+
+    /* Do not lend the free ranks the pool reclaimer keeps for allocations */
+    return atomic_read(&ctx->nr_free_ranks) > READ_ONCE(membo_pool_min_free_ranks);
+}
+
+/*
+ * Must be called with the membo lock of the node held. Returns a free rank
+ * of the node on a channel no lent rank uses.
+ */
+static struct dpu_rank_t *pick_stripe_free_rank(int nid)
+{
+    struct dpu_rank_t *free_rank, *lent_rank;
+
+    list_for_each_entry (free_rank, &membo_context_list[nid]->free_rank_list, state_list) {
+        bool new_channel = true;
+
+        list_for_each_entry (lent_rank, &membo_context_list[nid]->ltb_rank_list, state_list)
+            if (membo_rank_distance(free_rank, lent_rank) < 2) {
+                new_channel = false;
+                break;
+            }
+
+        if (new_channel)
+            return free_rank;
+    }
+
+    return NULL;
+}
+
+/*
+ * Must be called with the membo lock of the node held. Lends sections
+ * round-robin over up to stripe lent ranks on distinct channels, so that
+ * the bandwidth of the borrowed memory scales with the channels: a free
+ * rank on a new channel joins the stripe while there are fewer than stripe
+ * lent ranks, otherwise the least lent rank gets the section.
+ */
+static int borrow_one_striped_section(int nid, unsigned int stripe)
+{
+    membo_context_t *ctx = membo_context_list[nid];
+    struct dpu_rank_t *rank_iterator, *target_rank = NULL;
+
+    if (atomic_read(&ctx->nr_ltb_ranks) < stripe && membo_can_lend_rank(nid)) {
+        target_rank = pick_stripe_free_rank(nid);
+        if (target_rank && membo_lend_rank(target_rank, nid) == DPU_OK)
+            goto lend_section;
+        target_rank = NULL;
+    }
+
+    list_for_each_entry (rank_iterator, &ctx->ltb_rank_list, state_list) {
+        int nr_sections = atomic_read(&rank_iterator->nr_ltb_sections);
+
+        if (nr_sections == SECTIONS_PER_DPU_RANK)
+            continue;
+        if (!target_rank || nr_sections < atomic_read(&target_rank->nr_ltb_sections))
+            target_rank = rank_iterator;
+    }
+
+    if (target_rank) {
+        ctx->ltb_index = target_rank;
+        goto lend_section;
+    }
+
+    /* The stripe is full, start a new one */
+    if (!membo_can_lend_rank(nid) || dpu_membo_rank_alloc(&target_rank, nid) != DPU_OK)
+        return -EBUSY;
+
+lend_section:
+    return lend_one_section(target_rank);
+}
+
+/* Must be called with the membo lock of the node held */
+static int borrow_one_section(int nid)
 {
     struct dpu_rank_t *current_ltb_rank;
+    unsigned int stripe = READ_ONCE(membo_borrow_stripe);
+
+    if (stripe > 1)
+        return borrow_one_striped_section(nid, stripe);
 
-    membo_lock(nid);
     current_ltb_rank = membo_context_list[nid]->ltb_index;
 
     if (current_ltb_rank)
         if (atomic_read(&current_ltb_rank->nr_ltb_sections) != SECTIONS_PER_DPU_RANK)
             goto request_one_section;
 
+    /* Fill the holes left by the reclamation of cold sections first */
+    list_for_each_entry (current_ltb_rank, &membo_context_list[nid]->ltb_rank_list, state_list)
+        if (atomic_read(&current_ltb_rank->nr_ltb_sections) != SECTIONS_PER_DPU_RANK) {
+            membo_context_list[nid]->ltb_index = current_ltb_rank;
+            goto request_one_section;
+        }
+
     /* try to allocate a new rank for MEMBO */
-    if (atomic_read(&membo_context_list[nid]->nr_ltb_ranks) >= atomic_read(&membo_context_list[nid]->nr_total_ranks) - atomic_read(&membo_context_list[nid]->nr_reserved_ranks)) {
+    if (!membo_can_lend_rank(nid)) {
         pr_info("Fail to borrow a rank\n");
-        membo_unlock(nid);
         return -EBUSY;
     }
 
-    if (dpu_membo_rank_alloc(&current_ltb_rank, nid) == DPU_OK)
-        goto request_one_section;
+    if (dpu_membo_rank_alloc(&current_ltb_rank, nid) != DPU_OK)
+        return -EBUSY;
+
+request_one_section:
+    return lend_one_section(current_ltb_rank);
+}
+
+/*
+ * Must be called with the membo lock of the node held. Returns the lent rank
+ * with the fewest sections if the other lent ranks have enough holes to take
+ * all of them, that is if the node lends at least a rank worth of holes.
+ */
+static struct dpu_rank_t *pick_compaction_source(int nid)
+{
+    struct dpu_rank_t *rank_iterator, *sparse_rank = NULL;
+    unsigned long nr_holes = 0;
+
+    list_for_each_entry (rank_iterator, &membo_context_list[nid]->ltb_rank_list, state_list) {
+        nr_holes += SECTIONS_PER_DPU_RANK - atomic_read(&rank_iterator->nr_ltb_sections);
+        if (!sparse_rank ||
+            atomic_read(&rank_iterator->nr_ltb_sections) < atomic_read(&sparse_rank->nr_ltb_sections))
+            sparse_rank = rank_iterator;
+    }
+
+    return nr_holes >= SECTIONS_PER_DPU_RANK ? sparse_rank : NULL;
+}
+
+/* Must be called with the membo lock of the node held */
+static struct dpu_rank_t *pick_compaction_target(int nid)
+{
+    struct dpu_rank_t *rank_iterator, *dense_rank = NULL;
+
+    list_for_each_entry (rank_iterator, &membo_context_list[nid]->ltb_rank_list, state_list) {
+        int nr_sections = atomic_read(&rank_iterator->nr_ltb_sections);
+
+        if (nr_sections == SECTIONS_PER_DPU_RANK)
+            continue;
+        if (!dense_rank || nr_sections > atomic_read(&dense_rank->nr_ltb_sections))
+            dense_rank = rank_iterator;
+    }
+
+    return dense_rank;
+}
+
+/*
+ * Compactor: while the kernel neither borrows nor reclaims on the node, empties
+ * the sparsest lent rank so that it becomes free. For each of its sections, a
+ * hole of the densest lent rank is lent first, then the sparse section is
+ * reclaimed. Its pages migrate wherever the kernel places them on the node,
+ * not necessarily into that hole: compaction only frees whole ranks, the
+ * lent footprint of the node is unchanged in the end but grows by a section
+ * while one is in flight. The sparse rank is taken out of ltb_rank_list
+ * meanwhile, and no section is started after membo_compact_budget_ms.
+ */
+static void membo_compact_work_fn(struct work_struct *work)
+{
+    membo_context_t *ctx = container_of(to_delayed_work(work), membo_context_t, compact_work);
+    s64 budget_us = (s64)READ_ONCE(membo_compact_budget_ms) * USEC_PER_MSEC;
+    struct dpu_rank_t *sparse_rank, *dense_rank;
+    unsigned long section_id;
+    ktime_t start = ktime_get();
+    int nid = ctx->nid;
+
+    if (!budget_us)
+        return;
+
+    membo_lock(nid);
+
+    if (time_before(jiffies, ctx->last_borrow_jiffies + MEMBO_COMPACT_INTERVAL) ||
+        time_before(jiffies, ctx->last_reclaim_jiffies + MEMBO_COMPACT_INTERVAL))
+        goto out;
+
+    /* Striped borrowing spreads sections over that many ranks on purpose */
+    if (atomic_read(&ctx->nr_ltb_ranks) <= READ_ONCE(membo_borrow_stripe))
+        goto out;
+
+    sparse_rank = pick_compaction_source(nid);
+    if (!sparse_rank)
+        goto out;
+
+    membo_rank_set_state(sparse_rank, MEMBO_RANK_RECLAIMING);
+    membo_update_ltb_index(nid);
+    membo_unlock(nid);
+
+    for_each_set_bit (section_id, sparse_rank->ltb_sections, SECTIONS_PER_DPU_RANK) {
+        if (ktime_us_delta(ktime_get(), start) >= budget_us)
+            break;
+
+        membo_lock(nid);
+        dense_rank = pick_compaction_target(nid);
+        if (dense_rank && lend_one_section(dense_rank))
+            dense_rank = NULL;
+        membo_unlock(nid);
+
+        if (!dense_rank)
+            break;
+
+        reclaim_one_section(sparse_rank, section_id);
+
+        membo_lock(nid);
+        clear_bit(section_id, sparse_rank->ltb_sections);
+        membo_add_rank_sections(sparse_rank, -1);
+        ctx->stats.nr_compacted++;
+        membo_unlock(nid);
+    }
+
+    membo_lock(nid);
+    if (!atomic_read(&sparse_rank->nr_ltb_sections)) {
+        dpu_membo_rank_free(&sparse_rank, nid);
+        ctx->stats.nr_compacted_ranks++;
+    } else {
+        membo_rank_set_state(sparse_rank, MEMBO_RANK_LENT);
+        membo_update_ltb_index(nid);
+    }
 
+out:
     membo_unlock(nid);
-    return -EBUSY;
 
-request_one_section:
-    expand_one_section(current_ltb_rank, atomic_read(&current_ltb_rank->nr_ltb_sections));
-    atomic_inc(&current_ltb_rank->nr_ltb_sections);
+    if (READ_ONCE(membo_compact_budget_ms))
+        queue_delayed_work(system_unbound_wq, &ctx->compact_work, MEMBO_COMPACT_INTERVAL);
+}
+
+/* Number of sections to lend for one borrowing request */
+static unsigned long membo_borrow_batch(int nid)
+{
+    membo_context_t *ctx = membo_context_list[nid];
+    unsigned long nr_free_pages = membo_node_free_pages(nid);
+
+    if (nr_free_pages >= ctx->borrow_low_wmark)
+        return 1;
+
+    return min_t(unsigned long,
+                 DIV_ROUND_UP(ctx->borrow_high_wmark - nr_free_pages, PAGES_PER_SECTION),
+                 MEMBO_MAX_BORROW_BATCH);
+}
+
+/*
+ * Must be called with the membo lock of the node held. Returns false once
+ * the node has moved membo_rate_limit sections in the current second.
+ */
+static bool membo_rate_allow(membo_context_t *ctx)
+{
+    unsigned int rate_limit = READ_ONCE(membo_rate_limit);
+
+    if (!rate_limit)
+        return true;
+
+    if (time_after_eq(jiffies, ctx->rate_window_start + HZ)) {
+        ctx->rate_window_start = jiffies;
+        ctx->rate_count = 0;
+    }
+
+    if (ctx->rate_count < rate_limit)
+        return true;
+
+    ctx->stats.nr_throttled++;
+    return false;
+}
+
+int request_mram_borrowing(int nid)
+{
+    membo_context_t *ctx = membo_context_list[nid];
+    unsigned long nr_sections, nr_borrowed = 0;
+    ktime_t start = ktime_get();
+
+    membo_lock(nid);
+
+    nr_sections = membo_borrow_batch(nid);
+    while (nr_borrowed < nr_sections && membo_rate_allow(ctx) && !borrow_one_section(nid)) {
+        ctx->rate_count++;
+        nr_borrowed++;
+    }
+
+    if (nr_borrowed) {
+        /* Borrowing right after a reclamation */
+        if (time_before(jiffies, ctx->last_reclaim_jiffies + MEMBO_FLAP_WINDOW))
+            ctx->stats.nr_flaps++;
+        ctx->last_borrow_jiffies = jiffies;
+        ctx->stats.nr_borrowed += nr_borrowed;
+    }
+
     membo_unlock(nid);
-    return 0;
+
+    pr_debug("membo: node %d borrowed %lu/%lu sections in %lld us\n", nid,
+             nr_borrowed, nr_sections, ktime_us_delta(ktime_get(), start));
+
+    return nr_borrowed ? 0 : -EBUSY;
 }
 
 int request_mram_reclamation(int nid)
 {
+    membo_context_t *ctx = membo_context_list[nid];
     struct dpu_rank_t *current_ltb_rank;
+    unsigned long section_id;
 
     membo_lock(nid);
-    current_ltb_rank = membo_context_list[nid]->ltb_index;
 
     if (!atomic_read(&membo_context_list[nid]->nr_ltb_ranks)) {
         membo_unlock(nid);
         return -EBUSY;
     }
 
-    atomic_dec(&current_ltb_rank->nr_ltb_sections);
-    reclaim_one_section(current_ltb_rank, atomic_read(&current_ltb_rank->nr_ltb_sections));
+    if (membo_node_free_pages(nid) < ctx->borrow_high_wmark + READ_ONCE(membo_hysteresis_pages) +
+                                     PAGES_PER_SECTION) {
+        ctx->stats.nr_deferred++;
+        membo_unlock(nid);
+        return -EBUSY;
+    }
+
+    if (!membo_rate_allow(ctx)) {
+        membo_unlock(nid);
+        return -EBUSY;
+    }
+
+    /* Reclaim the coldest section, its pages are the cheapest to migrate */
+    current_ltb_rank = pick_coldest_section(nid, &section_id, READ_ONCE(membo_borrow_stripe) > 1,
+                                            READ_ONCE(membo_min_residency));
+    if (!current_ltb_rank) {
+        /* Every lent section is younger than membo_min_residency */
+        ctx->stats.nr_deferred++;
+        membo_unlock(nid);
+        return -EBUSY;
+    }
+
+    reclaim_one_section(current_ltb_rank, section_id);
+    clear_bit(section_id, current_ltb_rank->ltb_sections);
 
+    membo_add_rank_sections(current_ltb_rank, -1);
     if (!atomic_read(&current_ltb_rank->nr_ltb_sections))
         dpu_membo_rank_free(&current_ltb_rank, nid);
 
+    /* Reclaiming right after a borrowing */
+    if (time_before(jiffies, ctx->last_borrow_jiffies + MEMBO_FLAP_WINDOW))
+        ctx->stats.nr_flaps++;
+    ctx->last_reclaim_jiffies = jiffies;
+    ctx->stats.nr_reclaimed++;
+    ctx->rate_count++;
+
     membo_unlock(nid);
     return 0;
 }
@@ -2,25 +2,108 @@
 #define DPU_MEMBO_H
 
 #include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 #include <dpu_region.h>
 #include <dpu_rank.h>
 
-#define PAGES_PER_DPU_RANK (DPU_RANK_SIZE / PAGE_SIZE)
-#define SECTIONS_PER_DPU_RANK (PAGES_PER_DPU_RANK / PAGES_PER_SECTION)
-
 #define DPU_MEMBO_NAME "dpu_membo"
 
+/* Upper bound of the sections lent by one borrowing request */
+#define MEMBO_MAX_BORROW_BATCH SECTIONS_PER_DPU_RANK
+
+/* Period of the pool reclaimer of a node, when enabled */
+#define MEMBO_POOL_INTERVAL HZ
+
+/* A borrowing and a reclamation closer than this are counted as a flap */
+#define MEMBO_FLAP_WINDOW HZ
+
+/* Pages sampled per lent section, and period of the heat sampler */
+#define MEMBO_HEAT_SAMPLES 32
+#define MEMBO_HEAT_INTERVAL (5 * HZ)
+
+/* Period of the compactor of a node, which only runs when the node is idle */
+#define MEMBO_COMPACT_INTERVAL HZ
+
+/* Async allocations a file may have waiting for ranks */
+#define MEMBO_MAX_ASYNC_REQUESTS 16
+
+/*
+ * A rank of a node is in exactly one of these states, and in the matching
+ * list of its membo_context, so that allocations pop ranks in O(1).
+ */
+enum membo_rank_state {
+    /* Neither allocated nor lent */
+    MEMBO_RANK_FREE,
+    /* Reserved by an allocation request, not opened yet */
+    MEMBO_RANK_RESERVED,
+    /* Opened by userspace or allocated by the kernel API */
+    MEMBO_RANK_USED,
+    /* Lent to the system memory (MEMBO borrowing) */
+    MEMBO_RANK_LENT,
+    /* Taken back from the system memory, its sections being migrated */
+    MEMBO_RANK_RECLAIMING,
+};
+
+/* Kernel borrowing and reclamation requests of a node, in sections */
+struct membo_stats {
+    unsigned long nr_borrowed;
+    unsigned long nr_reclaimed;
+    /* Borrowing and reclamation in a row, within MEMBO_FLAP_WINDOW */
+    unsigned long nr_flaps;
+    /* Reclamations refused by the hysteresis or the minimum residency */
+    unsigned long nr_deferred;
+    /* Requests refused by the rate limiter */
+    unsigned long nr_throttled;
+    /* Sections moved and ranks freed by the compactor */
+    unsigned long nr_compacted;
+    unsigned long nr_compacted_ranks;
+};
+
 typedef struct membo_context {
     int nid;
+    /* Protects the rank lists and ltb_index. It is only held for short
+     * critical sections, never while sections are being migrated.
+     */
     struct mutex mutex;
+    /* All the ranks of the node, linked by rank->list */
     struct list_head rank_list;
+    /* Ranks by state, linked by rank->state_list */
+    struct list_head free_rank_list;
+    struct list_head reserved_rank_list;
+    struct list_head used_rank_list;
     struct list_head ltb_rank_list;
+    struct list_head reclaiming_rank_list;
+    /* Lent rank being filled */
     struct dpu_rank_t *ltb_index;
     atomic_t nr_free_ranks;
+    atomic_t nr_pending_ranks;
     atomic_t nr_used_ranks;
     atomic_t nr_ltb_ranks;
+    atomic_t nr_reclaiming_ranks;
+    /* Ranks that cannot be lent */
     atomic_t nr_reserved_ranks;
     atomic_t nr_total_ranks;
+    /* Sections of the lent and reclaiming ranks, under the mutex */
+    unsigned long nr_ltb_sections;
+    /* In pages: below borrow_low_wmark free pages, a borrowing request
+     * lends enough sections to get back to borrow_high_wmark.
+     */
+    unsigned long borrow_low_wmark;
+    unsigned long borrow_high_wmark;
+    /* Keeps free ranks ready for allocations, see membo_pool_work_fn */
+    struct delayed_work pool_work;
+    /* Estimates the heat of the lent sections, see membo_heat_work_fn */
+    struct delayed_work heat_work;
+    /* Frees sparsely lent ranks, see membo_compact_work_fn */
+    struct delayed_work compact_work;
+    /* Damping of the kernel requests, see request_mram_reclamation */
+    unsigned long last_borrow_jiffies;
+    unsigned long last_reclaim_jiffies;
+    unsigned long rate_window_start;
+    unsigned int rate_count;
+    struct membo_stats stats;
 } membo_context_t;
 
 struct dpu_membo_fs {
@@ -30,9 +113,91 @@ struct dpu_membo_fs {
     struct mutex mutex;
 };
 
+/* State of an open file of /dev/dpu_membo */
+struct dpu_membo_file {
+    struct dpu_membo_fs *fs;
+    /* Protects events, requests, nr_requests and next_request_id */
+    spinlock_t lock;
+    /* Completion events of the async allocations, returned by read() */
+    struct list_head events;
+    wait_queue_head_t wait;
+    /* Async allocations still reclaiming ranks, see membo_async_work_fn */
+    struct list_head requests;
+    unsigned int nr_requests;
+    uint32_t next_request_id;
+};
+
+/* Nodes an allocation takes its ranks from */
+enum dpu_membo_node_policy {
+    /* Any online node, in order */
+    DPU_MEMBO_NODE_ANY = 0,
+    /* The nodes of node_mask first, then the other ones */
+    DPU_MEMBO_NODE_PREFERRED,
+    /* The nodes of node_mask only */
+    DPU_MEMBO_NODE_STRICT,
+};
+
+#define DPU_MEMBO_MAX_ALLOC_RANKS 64
+
+/* Spread the ranks over distinct channels, then DIMMs, rather than pack them */
+#define DPU_MEMBO_ALLOC_SPREAD (1 << 0)
+/*
+ * Rather than fail with -EBUSY, wait in the admission queue until enough
+ * ranks are free or lent, see membo_admission_enter
+ */
+#define DPU_MEMBO_ALLOC_WAIT (1 << 1)
+#define DPU_MEMBO_ALLOC_FLAGS (DPU_MEMBO_ALLOC_SPREAD | DPU_MEMBO_ALLOC_WAIT)
+
+/*
+ * Layout of the allocation ioctls 0 and 1, which encode a pointer size:
+ * the leading fields of struct dpu_membo_allocation_context, the other
+ * ones are taken as zero.
+ */
+struct dpu_membo_legacy_allocation_context {
+    int nr_req_ranks;
+    int nr_alloc_ranks;
+};
+
+/* Layout of the _EXT allocation ioctls, whose number encodes its size */
 struct dpu_membo_allocation_context {
     int nr_req_ranks;
     int nr_alloc_ranks;
+    /* Bit n stands for node n */
+    uint64_t node_mask;
+    uint32_t node_policy;
+    /* DPU_MEMBO_ALLOC_* */
+    uint32_t flags;
+    /* DPU_MEMBO_ALLOC_WAIT: higher priorities are granted first, then in
+     * arrival order. -ETIMEDOUT after timeout_ms, 0: no timeout. It also
+     * bounds the wait of the missing ranks of an async allocation.
+     */
+    uint32_t priority;
+    uint32_t timeout_ms;
+    /* Async allocation: id of the events of the missing ranks, 0 if none */
+    uint32_t request_id;
+    /* Filled in with the node and the id (/dev/dpu_rank<id>) of each of the
+     * nr_alloc_ranks ranks
+     */
+    int32_t rank_nids[DPU_MEMBO_MAX_ALLOC_RANKS];
+    int32_t rank_ids[DPU_MEMBO_MAX_ALLOC_RANKS];
+};
+
+/*
+ * Read from /dev/dpu_membo: one event per rank reserved for the async
+ * allocation request_id after the ioctl returned, with status 0. Ranks in
+ * use or being reclaimed are waited for until the timeout_ms of the
+ * allocation, if any: then a last event with status -ETIMEDOUT and no rank
+ * (nid and rank_id -1) ends the request. Closing the file cancels it. A
+ * file has at most MEMBO_MAX_ASYNC_REQUESTS requests, the ioctl fails with
+ * -EBUSY beyond.
+ */
+struct dpu_membo_event {
+    uint32_t request_id;
+    int32_t status;
+    int32_t nid;
+    int32_t rank_id;
+    /* Ranks still missing for the request after this event */
+    uint32_t nr_remaining;
 };
 
 struct dpu_membo_dynamic_reservation_context {
@@ -44,12 +209,74 @@ struct dpu_membo_usage_context {
     int nr_used_ranks;
 };
 
+/* Borrowing watermarks of a node, in MB of free memory */
+struct dpu_membo_watermark_context {
+    int nid;
+    uint64_t low_wmark_mb;
+    uint64_t high_wmark_mb;
+};
+
+#define DPU_MEMBO_STATUS_MAX_NODES 64
+
+/*
+ * Counters of a node in the status page. The driver makes seq odd while it
+ * updates them: a reader retries while seq is odd, or if seq changed during
+ * its read.
+ */
+struct dpu_membo_node_status {
+    uint32_t seq;
+    uint32_t nr_total_ranks;
+    uint32_t nr_free_ranks;
+    /* Reserved by an allocation request, not opened yet (MEMBO_RANK_RESERVED),
+     * unlike the ranks the lending threshold keeps from being lent
+     */
+    uint32_t nr_pending_ranks;
+    uint32_t nr_used_ranks;
+    uint32_t nr_lent_ranks;
+    uint32_t nr_reclaiming_ranks;
+    /* Sections of the lent and reclaiming ranks */
+    uint32_t nr_borrowed_sections;
+};
+
+/* Read-only page mmap()ed from /dev/dpu_membo, at offset 0 */
+struct dpu_membo_status {
+    /* nodes[] holds the node ids below nr_nodes */
+    uint32_t nr_nodes;
+    uint32_t pad;
+    struct dpu_membo_node_status nodes[DPU_MEMBO_STATUS_MAX_NODES];
+};
+
+#define DPU_MEMBO_MAX_XFER_RANKS 256
+
+/* Transfer to or from the rank opened as rank_fd */
+struct dpu_membo_rank_xfer {
+    int rank_fd;
+    struct dpu_transfer_mram *xfer_matrix;
+};
+
+struct dpu_membo_xfer_context {
+    uint32_t nr_ranks;
+    struct dpu_membo_rank_xfer *rank_xfers;
+};
+
 void membo_lock(int nid);
 void membo_unlock(int nid);
 
+void membo_add_rank(struct dpu_rank_t *rank);
+void membo_remove_rank(struct dpu_rank_t *rank);
+struct dpu_rank_t *membo_first_rank(int nid, enum membo_rank_state state);
+struct dpu_rank_t *membo_spread_free_rank(int nid, struct dpu_rank_t **spread,
+                                          int nr_spread);
+void membo_rank_set_state(struct dpu_rank_t *rank,
+                          enum membo_rank_state state);
+void membo_pool_kick(int nid);
+
 void membo_fs_lock(void);
 void membo_fs_unlock(void);
 
+int dpu_rank_batch_xfer(struct dpu_membo_xfer_context *xfer_context,
+                        bool write);
+
 uint32_t dpu_membo_rank_alloc(struct dpu_rank_t **rank, int nid);
 uint32_t dpu_membo_rank_free(struct dpu_rank_t **rank, int nid);
 
@@ -5,9 +5,16 @@
 
 #define DPU_MEMBO_IOCTL_MAGIC 'd'
 
+/* Legacy allocations, on a struct dpu_membo_legacy_allocation_context */
 #define DPU_MEMBO_IOCTL_ALLOC_RANKS_DIRECT _IOWR(DPU_MEMBO_IOCTL_MAGIC, 0, struct dpu_membo_allocation_context *)
 #define DPU_MEMBO_IOCTL_ALLOC_RANKS_ASYNC _IOWR(DPU_MEMBO_IOCTL_MAGIC, 1, struct dpu_membo_allocation_context *)
 #define DPU_MEMBO_IOCTL_SET_THRESHOLD _IOWR(DPU_MEMBO_IOCTL_MAGIC, 2, struct dpu_membo_dynamic_threshold_context *)
 #define DPU_MEMBO_IOCTL_GET_USAGE _IOWR(DPU_MEMBO_IOCTL_MAGIC, 3, struct dpu_membo_usage_context *)
+#define DPU_MEMBO_IOCTL_WRITE_TO_RANKS _IOW(DPU_MEMBO_IOCTL_MAGIC, 4, struct dpu_membo_xfer_context *)
+#define DPU_MEMBO_IOCTL_READ_FROM_RANKS _IOW(DPU_MEMBO_IOCTL_MAGIC, 5, struct dpu_membo_xfer_context *)
+#define DPU_MEMBO_IOCTL_SET_WATERMARKS _IOW(DPU_MEMBO_IOCTL_MAGIC, 6, struct dpu_membo_watermark_context *)
+/* Allocations on the whole struct dpu_membo_allocation_context */
+#define DPU_MEMBO_IOCTL_ALLOC_RANKS_DIRECT_EXT _IOWR(DPU_MEMBO_IOCTL_MAGIC, 7, struct dpu_membo_allocation_context)
+#define DPU_MEMBO_IOCTL_ALLOC_RANKS_ASYNC_EXT _IOWR(DPU_MEMBO_IOCTL_MAGIC, 8, struct dpu_membo_allocation_context)
 
 #endif
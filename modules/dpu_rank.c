@@ -14,6 +14,8 @@
 #include <asm/cacheflush.h>
 #include <linux/sched.h>
 #include <linux/string.h>
+#include <linux/file.h>
+#include <linux/workqueue.h>
 
 #include <dpu_rank.h>
 #include <dpu_rank_ioctl.h>
@@ -54,20 +56,59 @@ static struct page **get_page_array(struct dpu_rank_t *rank, int dpu_idx)
 	return &rank->xfer_dpu_page_array[dpu_idx * nb_page_in_array + dpu_idx];
 }
 
-/* Returns pages that must be put and free by calling function,
- * note that in case of success, the caller must release mmap_lock. */
+/*
+ * User pages are pinned with the fast GUP variants, that do not need
+ * mmap_lock: a transfer to a rank then does not stall page faults and
+ * mappings of the other threads of the process.
+ */
+long dpu_rank_pin_user_pages(unsigned long start, unsigned long nb_pages,
+			     unsigned int gup_flags, struct page **pages)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+	return pin_user_pages_fast(start, nb_pages, gup_flags, pages);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0)
+	return get_user_pages_fast(start, nb_pages, gup_flags, pages);
+#else
+	return get_user_pages_fast(start, nb_pages, gup_flags & FOLL_WRITE,
+				   pages);
+#endif
+}
+
+/* Pages the rank was read into are dirty behind the page tables back */
+void dpu_rank_unpin_user_pages(struct page **pages, unsigned long nb_pages,
+			       bool dirty)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+	unpin_user_pages_dirty_lock(pages, nb_pages, dirty);
+#else
+	unsigned long i;
+
+	for (i = 0; i < nb_pages; ++i) {
+		if (dirty)
+			set_page_dirty_lock(pages[i]);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+		unpin_user_page(pages[i]);
+#else
+		put_page(pages[i]);
+#endif
+	}
+#endif
+}
+
+/* Returns pages that must be unpinned by calling function */
 static int pin_pages_for_xfer(struct device *dev, struct dpu_rank_t *rank,
 			      struct dpu_transfer_mram *xfer,
 			      unsigned int gup_flags, int dpu_idx)
 {
 	struct xfer_page *xferp;
-	unsigned long nb_pages, nb_pages_expected;
+	unsigned long nb_pages_expected;
+	long nb_pages;
 	uint32_t off_page;
 	int i;
 	uint8_t *ptr_user =
 		xfer->ptr[dpu_idx]; /* very important to keep this address,
 					* since it will get overriden by
-					* get_user_pages
+					* dpu_rank_pin_user_pages
 					*/
 
 	/* Allocation from userspace may not be aligned to
@@ -92,18 +133,16 @@ static int pin_pages_for_xfer(struct device *dev, struct dpu_rank_t *rank,
 	if (nb_pages_expected == 0)
 		return 0;
 
-#if LINUX_VERSION_CODE > KERNEL_VERSION(3, 10, 0)
 	/* Note: If needed, PageTransHuge returns true in case of a huge page */
-	nb_pages = get_user_pages((unsigned long)ptr_user, xferp->nb_pages,
-				  gup_flags, xferp->pages, NULL);
-#else
-	nb_pages = get_user_pages(current, current->mm, (unsigned long)ptr_user,
-				  xferp->nb_pages, gup_flags, 0, xferp->pages,
-				  NULL);
-#endif
+	nb_pages = dpu_rank_pin_user_pages((unsigned long)ptr_user,
+					   xferp->nb_pages, gup_flags,
+					   xferp->pages);
 	if (nb_pages <= 0 || nb_pages != nb_pages_expected) {
 		dev_err(dev, "cannot pin pages: nb_pages %ld/expected %ld\n",
 			nb_pages, nb_pages_expected);
+		if (nb_pages > 0)
+			dpu_rank_unpin_user_pages(xferp->pages, nb_pages,
+						  false);
 		return -EFAULT;
 	}
 
@@ -168,7 +207,31 @@ static int get_pages_for_xfer(struct device *dev, struct dpu_rank_t *rank,
 	return xferp->nb_pages;
 }
 
-/* Careful to release mmap_lock ! */
+static void put_pages_for_xfer_matrix(struct dpu_rank_t *rank,
+				      struct dpu_transfer_mram *xfer_matrix,
+				      bool dirty)
+{
+	struct dpu_region_address_translation *tr;
+	uint8_t ci_id, dpu_id, nb_cis, nb_dpus_per_ci;
+	int idx;
+
+	tr = &rank->region->addr_translate;
+	nb_cis = tr->desc.topology.nr_of_control_interfaces;
+	nb_dpus_per_ci = tr->desc.topology.nr_of_dpus_per_control_interface;
+
+	for_each_dpu_in_rank(idx, ci_id, dpu_id, nb_cis, nb_dpus_per_ci)
+	{
+		if (xfer_matrix->ptr[idx]) {
+			struct xfer_page *xferp;
+
+			xferp = xfer_matrix->ptr[idx];
+
+			dpu_rank_unpin_user_pages(xferp->pages,
+						  xferp->nb_pages, dirty);
+		}
+	}
+}
+
 static int pin_pages_for_xfer_matrix(struct device *dev,
 				     struct dpu_rank_t *rank,
 				     struct dpu_transfer_mram *xfer_matrix,
@@ -183,12 +246,6 @@ static int pin_pages_for_xfer_matrix(struct device *dev,
 	nb_cis = tr->desc.topology.nr_of_control_interfaces;
 	nb_dpus_per_ci = tr->desc.topology.nr_of_dpus_per_control_interface;
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 8, 0)
-	down_read(&current->mm->mmap_sem);
-#else
-	down_read(&current->mm->mmap_lock);
-#endif
-
 	for_each_dpu_in_rank(idx, ci_id, dpu_id, nb_cis, nb_dpus_per_ci)
 	{
 		/* Here we work 'in-place' in xfer_matrix by replacing pointers
@@ -201,7 +258,7 @@ static int pin_pages_for_xfer_matrix(struct device *dev,
 		ret = pin_pages_for_xfer(dev, rank, xfer_matrix, gup_flags,
 					 idx);
 		if (ret < 0) {
-			int i, j;
+			int i;
 
 			for (i = idx - 1; i >= 0; --i) {
 				if (xfer_matrix->ptr[i]) {
@@ -209,15 +266,11 @@ static int pin_pages_for_xfer_matrix(struct device *dev,
 
 					xferp = xfer_matrix->ptr[i];
 
-					for (j = 0; j < xferp->nb_pages; ++j)
-						put_page(xferp->pages[j]);
+					dpu_rank_unpin_user_pages(
+						xferp->pages, xferp->nb_pages,
+						false);
 				}
 			}
-#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 8, 0)
-			up_read(&current->mm->mmap_sem);
-#else
-			up_read(&current->mm->mmap_lock);
-#endif
 			return ret;
 		}
 	}
@@ -270,20 +323,16 @@ static int dpu_rank_write_to_rank(struct dpu_rank_t *rank, unsigned long ptr)
 	struct device *dev = &rank->dev;
 	struct dpu_region_address_translation *tr;
 	struct dpu_transfer_mram xfer_matrix;
-	int i, ret = 0;
-	uint8_t ci_id, dpu_id, nb_cis, nb_dpus_per_ci;
-	int idx;
+	int ret = 0;
 
 	tr = &rank->region->addr_translate;
-	nb_cis = tr->desc.topology.nr_of_control_interfaces;
-	nb_dpus_per_ci = tr->desc.topology.nr_of_dpus_per_control_interface;
 
 	ret = dpu_rank_get_user_xfer_matrix(&xfer_matrix, ptr);
 	if (ret)
 		return ret;
 
 	/* Pin pages of all the buffers in the transfer matrix, and start
-	 * the transfer: from here we are committed to release mmap_lock.
+	 * the transfer.
 	 */
 	ret = pin_pages_for_xfer_matrix(dev, rank, &xfer_matrix, 0);
 	if (ret)
@@ -294,23 +343,7 @@ static int dpu_rank_write_to_rank(struct dpu_rank_t *rank, unsigned long ptr)
 			  &xfer_matrix);
 
 	/* Free pages */
-	for_each_dpu_in_rank(idx, ci_id, dpu_id, nb_cis, nb_dpus_per_ci)
-	{
-		if (xfer_matrix.ptr[idx]) {
-			struct xfer_page *xferp;
-
-			xferp = xfer_matrix.ptr[idx];
-
-			for (i = 0; i < xferp->nb_pages; ++i)
-				put_page(xferp->pages[i]);
-		}
-	}
-
-#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 8, 0)
-	up_read(&current->mm->mmap_sem);
-#else
-	up_read(&current->mm->mmap_lock);
-#endif
+	put_pages_for_xfer_matrix(rank, &xfer_matrix, false);
 
 	return ret;
 }
@@ -320,13 +353,9 @@ static int dpu_rank_read_from_rank(struct dpu_rank_t *rank, unsigned long ptr)
 	struct device *dev = &rank->dev;
 	struct dpu_region_address_translation *tr;
 	struct dpu_transfer_mram xfer_matrix;
-	int i, ret = 0;
-	uint8_t ci_id, dpu_id, nb_cis, nb_dpus_per_ci;
-	int idx;
+	int ret = 0;
 
 	tr = &rank->region->addr_translate;
-	nb_cis = tr->desc.topology.nr_of_control_interfaces;
-	nb_dpus_per_ci = tr->desc.topology.nr_of_dpus_per_control_interface;
 
 	ret = dpu_rank_get_user_xfer_matrix(&xfer_matrix, ptr);
 	if (ret)
@@ -336,12 +365,7 @@ static int dpu_rank_read_from_rank(struct dpu_rank_t *rank, unsigned long ptr)
 	 * the transfer. Check if the buffer is writable and do not forget
 	 * to fault in pages...
 	 */
-#if LINUX_VERSION_CODE > KERNEL_VERSION(3, 10, 0)
-	ret = pin_pages_for_xfer_matrix(dev, rank, &xfer_matrix,
-					FOLL_WRITE | FOLL_POPULATE);
-#else
 	ret = pin_pages_for_xfer_matrix(dev, rank, &xfer_matrix, FOLL_WRITE);
-#endif
 	if (ret)
 		return ret;
 
@@ -350,23 +374,7 @@ static int dpu_rank_read_from_rank(struct dpu_rank_t *rank, unsigned long ptr)
 			   &xfer_matrix);
 
 	/* Free pages */
-	for_each_dpu_in_rank(idx, ci_id, dpu_id, nb_cis, nb_dpus_per_ci)
-	{
-		if (xfer_matrix.ptr[idx]) {
-			struct xfer_page *xferp;
-
-			xferp = xfer_matrix.ptr[idx];
-
-			for (i = 0; i < xferp->nb_pages; ++i)
-				put_page(xferp->pages[i]);
-		}
-	}
-
-#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 8, 0)
-	up_read(&current->mm->mmap_sem);
-#else
-	up_read(&current->mm->mmap_lock);
-#endif
+	put_pages_for_xfer_matrix(rank, &xfer_matrix, true);
 
 	return ret;
 }
@@ -452,11 +460,11 @@ uint32_t dpu_rank_get(struct dpu_rank_t *rank)
 	return DPU_OK;
 }
 
+/* Must be called with the membo lock of the rank node held */
 void dpu_rank_put(struct dpu_rank_t *rank)
 {
 	struct dpu_region_address_translation *tr =
 		&rank->region->addr_translate;
-    pg_data_t *pgdat = NODE_DATA(rank->nid);
 
 	dpu_region_lock(rank->region);
 
@@ -474,11 +482,9 @@ void dpu_rank_put(struct dpu_rank_t *rank)
          */
 		rank->debug_mode = 0;
 		rank->region->mode = DPU_REGION_MODE_UNDEFINED;
-	}
 
-    if (atomic_inc_return(&membo_context_list[rank->nid]->nr_free_ranks) == 1) {
-        atomic_set(&pgdat->membo_disabled, 0);
-    }
+        membo_rank_set_state(rank, MEMBO_RANK_FREE);
+	}
 
 	dpu_region_unlock(rank->region);
 }
@@ -490,7 +496,11 @@ static int dpu_rank_open(struct inode *inode, struct file *filp)
 
     membo_lock(rank->nid);
 
-    if (!rank->is_reserved) {
+    /* Ranks must be reserved through dpu_membo first, in use ranks can
+     * still be opened in debug mode.
+     */
+    if (rank->membo_state != MEMBO_RANK_RESERVED &&
+        rank->membo_state != MEMBO_RANK_USED) {
         membo_unlock(rank->nid);
         return -EINVAL;
     }
@@ -503,7 +513,7 @@ static int dpu_rank_open(struct inode *inode, struct file *filp)
 		return -EINVAL;
     }
 
-    atomic_inc(&membo_context_list[rank->nid]->nr_used_ranks);
+    membo_rank_set_state(rank, MEMBO_RANK_USED);
 
     membo_unlock(rank->nid);
 	return 0;
@@ -516,15 +526,15 @@ static int dpu_rank_release(struct inode *inode, struct file *filp)
 	if (!rank)
 		return 0;
 
-    membo_lock(rank->nid);
-
 	dev_dbg(&rank->dev, "closed rank_id %u\n", rank->id);
 
-	dpu_rank_put(rank);
+	/* Waits for the ring worker, do not stall the node meanwhile */
+	dpu_rank_ring_release(rank, filp);
+	dpu_rank_release_buffers(rank, filp);
 
-    rank->is_reserved = false;
+    membo_lock(rank->nid);
 
-    atomic_dec(&membo_context_list[rank->nid]->nr_used_ranks);
+	dpu_rank_put(rank);
 
     membo_unlock(rank->nid);
 
@@ -542,6 +552,46 @@ static int dpu_rank_debug_mode(struct dpu_rank_t *rank, unsigned long mode)
 	return 0;
 }
 
+/*
+ * Runs a transfer or command operation, posted in the submission ring of
+ * the rank or issued by an ioctl, under the rank xfer_lock.
+ */
+long dpu_rank_ring_op(struct dpu_rank_t *rank, struct file *filp,
+		      uint8_t opcode, unsigned long addr)
+{
+	long ret;
+
+	mutex_lock(&rank->xfer_lock);
+
+	switch (opcode) {
+	case DPU_RANK_RING_OP_WRITE_TO_RANK:
+		ret = dpu_rank_write_to_rank(rank, addr);
+		break;
+	case DPU_RANK_RING_OP_READ_FROM_RANK:
+		ret = dpu_rank_read_from_rank(rank, addr);
+		break;
+	case DPU_RANK_RING_OP_WRITE_TO_RANK_REGISTERED:
+		ret = dpu_rank_xfer_registered(rank, filp, addr, true);
+		break;
+	case DPU_RANK_RING_OP_READ_FROM_RANK_REGISTERED:
+		ret = dpu_rank_xfer_registered(rank, filp, addr, false);
+		break;
+	case DPU_RANK_RING_OP_COMMIT_COMMANDS:
+		ret = dpu_rank_commit_commands(rank, addr);
+		break;
+	case DPU_RANK_RING_OP_UPDATE_COMMANDS:
+		ret = dpu_rank_update_commands(rank, addr);
+		break;
+	default:
+		ret = -EINVAL;
+		break;
+	}
+
+	mutex_unlock(&rank->xfer_lock);
+
+	return ret;
+}
+
 static long dpu_rank_ioctl(struct file *filp, unsigned int cmd,
 			   unsigned long arg)
 {
@@ -555,24 +605,60 @@ static long dpu_rank_ioctl(struct file *filp, unsigned int cmd,
 
 	switch (cmd) {
 	case DPU_RANK_IOCTL_WRITE_TO_RANK:
-		ret = dpu_rank_write_to_rank(rank, arg);
+		ret = dpu_rank_ring_op(rank, filp,
+				       DPU_RANK_RING_OP_WRITE_TO_RANK, arg);
 
 		break;
 	case DPU_RANK_IOCTL_READ_FROM_RANK:
-		ret = dpu_rank_read_from_rank(rank, arg);
+		ret = dpu_rank_ring_op(rank, filp,
+				       DPU_RANK_RING_OP_READ_FROM_RANK, arg);
 
 		break;
 	case DPU_RANK_IOCTL_COMMIT_COMMANDS:
-		ret = dpu_rank_commit_commands(rank, arg);
+		ret = dpu_rank_ring_op(rank, filp,
+				       DPU_RANK_RING_OP_COMMIT_COMMANDS, arg);
 
 		break;
 	case DPU_RANK_IOCTL_UPDATE_COMMANDS:
-		ret = dpu_rank_update_commands(rank, arg);
+		ret = dpu_rank_ring_op(rank, filp,
+				       DPU_RANK_RING_OP_UPDATE_COMMANDS, arg);
 
 		break;
 	case DPU_RANK_IOCTL_DEBUG_MODE:
 		ret = dpu_rank_debug_mode(rank, arg);
 
+		break;
+	case DPU_RANK_IOCTL_REGISTER_BUFFER:
+		ret = dpu_rank_register_buffer(rank, filp, arg);
+
+		break;
+	case DPU_RANK_IOCTL_UNREGISTER_BUFFER:
+		ret = dpu_rank_unregister_buffer(rank, filp, arg);
+
+		break;
+	case DPU_RANK_IOCTL_WRITE_TO_RANK_REGISTERED:
+		ret = dpu_rank_ring_op(
+			rank, filp, DPU_RANK_RING_OP_WRITE_TO_RANK_REGISTERED,
+			arg);
+
+		break;
+	case DPU_RANK_IOCTL_READ_FROM_RANK_REGISTERED:
+		ret = dpu_rank_ring_op(
+			rank, filp, DPU_RANK_RING_OP_READ_FROM_RANK_REGISTERED,
+			arg);
+
+		break;
+	case DPU_RANK_IOCTL_SETUP_RING:
+		ret = dpu_rank_ring_setup(rank, filp, arg);
+
+		break;
+	case DPU_RANK_IOCTL_RING_ENTER:
+		ret = dpu_rank_ring_enter(rank, filp);
+
+		break;
+	case DPU_RANK_IOCTL_RING_EVENTFD:
+		ret = dpu_rank_ring_set_eventfd(rank, filp, (int)arg);
+
 		break;
 	default:
 		break;
@@ -592,6 +678,9 @@ static int dpu_rank_mmap(struct file *filp, struct vm_area_struct *vma)
 
 	tr = &rank->region->addr_translate;
 
+	if (vma->vm_pgoff == DPU_RANK_RING_MMAP_OFFSET >> PAGE_SHIFT)
+		return dpu_rank_ring_mmap(rank, filp, vma);
+
 	dpu_region_lock(rank->region);
 
 	switch (rank->region->mode) {
@@ -623,12 +712,162 @@ end:
 	return ret ? ret : tr->mmap_hybrid(tr, filp, vma);
 }
 
+static unsigned int dpu_rank_poll(struct file *filp, poll_table *wait)
+{
+	struct dpu_rank_t *rank = filp->private_data;
+
+	return dpu_rank_ring_poll(rank, filp, wait);
+}
+
 static struct file_operations dpu_rank_fops = { .owner = THIS_MODULE,
 						.open = dpu_rank_open,
 						.release = dpu_rank_release,
 						.unlocked_ioctl =
 							dpu_rank_ioctl,
-						.mmap = dpu_rank_mmap };
+						.mmap = dpu_rank_mmap,
+						.poll = dpu_rank_poll };
+
+/*
+ * Batched transfers: a single call moves data to or from several ranks,
+ * identified by file descriptors the caller has opened. All the buffers
+ * are pinned first, then the transfers of all ranks run in parallel, each
+ * on a worker of the rank NUMA node.
+ */
+struct dpu_rank_batch_xfer {
+	struct work_struct work;
+	struct file *filp;
+	struct dpu_rank_t *rank;
+	struct dpu_transfer_mram xfer_matrix;
+	bool write;
+};
+
+static DEFINE_MUTEX(dpu_rank_batch_lock);
+
+static void dpu_rank_batch_xfer_fn(struct work_struct *work)
+{
+	struct dpu_rank_batch_xfer *batch =
+		container_of(work, struct dpu_rank_batch_xfer, work);
+	struct dpu_rank_t *rank = batch->rank;
+	struct dpu_region_address_translation *tr =
+		&rank->region->addr_translate;
+
+	if (batch->write)
+		tr->write_to_rank(tr, rank->region->base, rank->channel_id,
+				  &batch->xfer_matrix);
+	else
+		tr->read_from_rank(tr, rank->region->base, rank->channel_id,
+				   &batch->xfer_matrix);
+}
+
+static int dpu_rank_batch_get(struct dpu_rank_batch_xfer *batch,
+			      struct dpu_membo_rank_xfer *rank_xfer)
+{
+	batch->filp = fget(rank_xfer->rank_fd);
+	if (!batch->filp)
+		return -EBADF;
+
+	if (batch->filp->f_op != &dpu_rank_fops ||
+	    !batch->filp->private_data) {
+		fput(batch->filp);
+		return -EINVAL;
+	}
+
+	batch->rank = batch->filp->private_data;
+
+	if (dpu_rank_get_user_xfer_matrix(
+		    &batch->xfer_matrix, (unsigned long)rank_xfer->xfer_matrix)) {
+		fput(batch->filp);
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+int dpu_rank_batch_xfer(struct dpu_membo_xfer_context *xfer_context,
+			bool write)
+{
+	struct dpu_membo_rank_xfer rank_xfer;
+	struct dpu_rank_batch_xfer *batches;
+	uint32_t nr_ranks = xfer_context->nr_ranks;
+	int i, j, nr_files = 0, ret = 0;
+
+	if (!nr_ranks || nr_ranks > DPU_MEMBO_MAX_XFER_RANKS)
+		return -EINVAL;
+
+	batches = kcalloc(nr_ranks, sizeof(*batches), GFP_KERNEL);
+	if (!batches)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_ranks; ++i) {
+		if (copy_from_user(&rank_xfer, &xfer_context->rank_xfers[i],
+				   sizeof(rank_xfer))) {
+			ret = -EFAULT;
+			goto put_files;
+		}
+
+		ret = dpu_rank_batch_get(&batches[i], &rank_xfer);
+		if (ret)
+			goto put_files;
+		nr_files++;
+
+		/* The pages of a rank are tracked in the rank itself */
+		for (j = 0; j < i; ++j) {
+			if (batches[j].rank == batches[i].rank) {
+				ret = -EINVAL;
+				goto put_files;
+			}
+		}
+
+		batches[i].write = write;
+	}
+
+	/* One batch at a time takes several rank locks, in any order */
+	mutex_lock(&dpu_rank_batch_lock);
+	for (i = 0; i < nr_ranks; ++i)
+		mutex_lock_nest_lock(&batches[i].rank->xfer_lock,
+				     &dpu_rank_batch_lock);
+	mutex_unlock(&dpu_rank_batch_lock);
+
+	for (i = 0; i < nr_ranks; ++i) {
+		ret = pin_pages_for_xfer_matrix(&batches[i].rank->dev,
+						batches[i].rank,
+						&batches[i].xfer_matrix,
+						write ? 0 : FOLL_WRITE);
+		if (ret) {
+			for (j = 0; j < i; ++j)
+				put_pages_for_xfer_matrix(
+					batches[j].rank,
+					&batches[j].xfer_matrix, false);
+			goto unlock_ranks;
+		}
+	}
+
+	for (i = 0; i < nr_ranks; ++i) {
+		INIT_WORK(&batches[i].work, dpu_rank_batch_xfer_fn);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+		queue_work_node(batches[i].rank->nid, system_unbound_wq,
+				&batches[i].work);
+#else
+		queue_work(system_unbound_wq, &batches[i].work);
+#endif
+	}
+
+	for (i = 0; i < nr_ranks; ++i) {
+		flush_work(&batches[i].work);
+		put_pages_for_xfer_matrix(batches[i].rank,
+					  &batches[i].xfer_matrix, !write);
+	}
+
+unlock_ranks:
+	for (i = 0; i < nr_ranks; ++i)
+		mutex_unlock(&batches[i].rank->xfer_lock);
+put_files:
+	for (i = 0; i < nr_files; ++i)
+		fput(batches[i].filp);
+	kfree(batches);
+
+	return ret;
+}
 
 static void dpu_rank_dev_release(struct device *dev)
 {
@@ -774,14 +1013,16 @@ int dpu_rank_copy_to_rank(struct dpu_rank_t *rank,
 
 	tr = &rank->region->addr_translate;
 
+	mutex_lock(&rank->xfer_lock);
+
 	ret = get_kernel_pages_for_xfer_matrix(dev, rank, xfer_matrix);
-	if (ret)
-		return ret;
+	if (!ret)
+		tr->write_to_rank(tr, rank->region->base, rank->channel_id,
+				  xfer_matrix);
 
-	tr->write_to_rank(tr, rank->region->base, rank->channel_id,
-			  xfer_matrix);
+	mutex_unlock(&rank->xfer_lock);
 
-	return 0;
+	return ret;
 }
 
 int dpu_rank_copy_from_rank(struct dpu_rank_t *rank,
@@ -793,14 +1034,16 @@ int dpu_rank_copy_from_rank(struct dpu_rank_t *rank,
 
 	tr = &rank->region->addr_translate;
 
+	mutex_lock(&rank->xfer_lock);
+
 	ret = get_kernel_pages_for_xfer_matrix(dev, rank, xfer_matrix);
-	if (ret)
-		return ret;
+	if (!ret)
+		tr->read_from_rank(tr, rank->region->base, rank->channel_id,
+				   xfer_matrix);
 
-	tr->read_from_rank(tr, rank->region->base, rank->channel_id,
-			   xfer_matrix);
+	mutex_unlock(&rank->xfer_lock);
 
-	return 0;
+	return ret;
 }
 
 int dpu_rank_init_device(struct device *dev, struct dpu_region *region,
@@ -847,15 +1090,15 @@ int dpu_rank_init_device(struct device *dev, struct dpu_region *region,
 		}
 	}
 
+	idr_init(&rank->buffers);
+	mutex_init(&rank->buffers_lock);
+	mutex_init(&rank->xfer_lock);
+
 	ret = dpu_rank_create_device(dev, region, rank, must_init_mram);
 	if (ret)
 		goto free_dpus;
 
-    atomic_set(&rank->nr_ltb_sections, 0);
-	list_add_tail(&rank->list, &(membo_context_list[rank->nid]->rank_list));
-    rank->is_reserved = false;
-    atomic_inc(&membo_context_list[rank->nid]->nr_free_ranks);
-    atomic_inc(&membo_context_list[rank->nid]->nr_total_ranks);
+    membo_add_rank(rank);
 
 	return 0;
 
@@ -870,7 +1113,7 @@ void dpu_rank_release_device(struct dpu_region *region)
 
 	pr_info("dpu_rank: releasing rank\n");
 
-	list_del(&rank->list);
+    membo_remove_rank(rank);
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
 	cdev_device_del(&rank->cdev, &rank->dev);
@@ -882,6 +1125,7 @@ void dpu_rank_release_device(struct dpu_region *region)
 	put_device(&rank->dev);
 	unregister_chrdev_region(rank->dev.devt, 1);
 	kfree(rank->dpus);
+	idr_destroy(&rank->buffers);
 }
 
 bool dpu_is_dimm_used(struct dpu_rank_t *rank)
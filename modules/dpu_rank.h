@@ -4,7 +4,9 @@
 #define DPU_RANK_INCLUDE_H
 
 #include <linux/fs.h>
+#include <linux/poll.h>
 #include <linux/device.h>
+#include <linux/mmzone.h>
 #include <linux/sizes.h>
 #include <linux/types.h>
 
@@ -21,6 +23,8 @@
 
 /* Size in bytes of one rank of a DPU DIMM */
 #define DPU_RANK_SIZE (8ULL * SZ_1G)
+#define PAGES_PER_DPU_RANK (DPU_RANK_SIZE / PAGE_SIZE)
+#define SECTIONS_PER_DPU_RANK (PAGES_PER_DPU_RANK / PAGES_PER_SECTION)
 
 /* The granularity of access to a rank is a cache line, which is 64 bytes */
 #define DPU_RANK_SIZE_ACCESS 64
@@ -57,6 +61,17 @@ struct dpu_runtime_state_t {
 	struct dpu_run_context_t run_context;
 };
 
+/* How write_to_rank pushes data to the MRAMs, see CAP_STREAM_WRITE */
+enum dpu_rank_write_mode {
+	/* Cached stores followed by a flush of the written lines */
+	DPU_RANK_WRITE_MODE_FLUSH = 0,
+	/* Full-line non-temporal stores, no flush needed */
+	DPU_RANK_WRITE_MODE_STREAM,
+};
+
+/* Upper bound of the xfer_workers rank attribute, see CAP_PARALLEL_XFER */
+#define DPU_RANK_MAX_XFER_WORKERS 8
+
 struct dpu_rank_owner {
 	uint8_t is_owned;
 	unsigned int usage_count;
@@ -97,6 +112,31 @@ int dpu_rank_copy_to_rank(struct dpu_rank_t *rank,
 int dpu_rank_copy_from_rank(struct dpu_rank_t *rank,
 			    struct dpu_transfer_mram *transfer_matrix);
 
+long dpu_rank_pin_user_pages(unsigned long start, unsigned long nb_pages,
+			     unsigned int gup_flags, struct page **pages);
+void dpu_rank_unpin_user_pages(struct page **pages, unsigned long nb_pages,
+			       bool dirty);
+int dpu_rank_register_buffer(struct dpu_rank_t *rank, struct file *filp,
+			     unsigned long ptr);
+int dpu_rank_unregister_buffer(struct dpu_rank_t *rank, struct file *filp,
+			       uint32_t handle);
+void dpu_rank_release_buffers(struct dpu_rank_t *rank, struct file *filp);
+int dpu_rank_xfer_registered(struct dpu_rank_t *rank, struct file *filp,
+			     unsigned long ptr, bool write);
+
+long dpu_rank_ring_op(struct dpu_rank_t *rank, struct file *filp,
+		      uint8_t opcode, unsigned long addr);
+int dpu_rank_ring_setup(struct dpu_rank_t *rank, struct file *filp,
+			unsigned long ptr);
+int dpu_rank_ring_enter(struct dpu_rank_t *rank, struct file *filp);
+int dpu_rank_ring_set_eventfd(struct dpu_rank_t *rank, struct file *filp,
+			      int fd);
+int dpu_rank_ring_mmap(struct dpu_rank_t *rank, struct file *filp,
+		       struct vm_area_struct *vma);
+unsigned int dpu_rank_ring_poll(struct dpu_rank_t *rank, struct file *filp,
+				poll_table *wait);
+void dpu_rank_ring_release(struct dpu_rank_t *rank, struct file *filp);
+
 bool dpu_is_dimm_used(struct dpu_rank_t *rank);
 
 extern const struct attribute_group *dpu_rank_attrs_groups[];
@@ -0,0 +1,232 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Copyright 2020 UPMEM. All rights reserved. */
+#include <linux/kernel.h>
+#include <linux/idr.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+
+#include <dpu_rank.h>
+#include <dpu_rank_ioctl.h>
+#include <dpu_region.h>
+
+/*
+ * Registered pages stay pinned for long, FOLL_LONGTERM keeps them out of
+ * CMA and ZONE_MOVABLE. It only exists from 5.2 on.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0)
+#define DPU_RANK_BUFFER_GUP_FLAGS (FOLL_WRITE | FOLL_LONGTERM)
+#else
+#define DPU_RANK_BUFFER_GUP_FLAGS FOLL_WRITE
+#endif
+
+/*
+ * Host buffers registered with a rank fd: their pages are pinned once, at
+ * registration, and transfers then refer to them by handle and offset,
+ * without pinning pages nor taking mmap_lock.
+ */
+struct dpu_rank_buffer_reg {
+	struct file *filp;
+	uint64_t size;
+	uint32_t off_first_page;
+	unsigned long nb_pages;
+	struct page **pages;
+};
+
+static void dpu_rank_buffer_free(struct dpu_rank_buffer_reg *reg)
+{
+	dpu_rank_unpin_user_pages(reg->pages, reg->nb_pages, true);
+	vfree(reg->pages);
+	kfree(reg);
+}
+
+int dpu_rank_register_buffer(struct dpu_rank_t *rank, struct file *filp,
+			     unsigned long ptr)
+{
+	struct dpu_rank_buffer buffer;
+	struct dpu_rank_buffer_reg *reg;
+	unsigned long start;
+	long nb_pages;
+	int ret;
+
+	if (copy_from_user(&buffer, (void *)ptr, sizeof(buffer)))
+		return -EFAULT;
+
+	if (!buffer.size || buffer.size > (uint64_t)INT_MAX * PAGE_SIZE)
+		return -EINVAL;
+
+	reg = kzalloc(sizeof(*reg), GFP_KERNEL);
+	if (!reg)
+		return -ENOMEM;
+
+	start = (unsigned long)buffer.ptr;
+	reg->filp = filp;
+	reg->size = buffer.size;
+	reg->off_first_page = start & (PAGE_SIZE - 1);
+	reg->nb_pages = DIV_ROUND_UP(reg->off_first_page + buffer.size,
+				     PAGE_SIZE);
+
+	reg->pages = vzalloc(reg->nb_pages * sizeof(struct page *));
+	if (!reg->pages) {
+		ret = -ENOMEM;
+		goto free_reg;
+	}
+
+	nb_pages = dpu_rank_pin_user_pages(start & PAGE_MASK, reg->nb_pages,
+					   DPU_RANK_BUFFER_GUP_FLAGS,
+					   reg->pages);
+	if (nb_pages != reg->nb_pages) {
+		dev_err(&rank->dev, "cannot pin buffer: nb_pages %ld/expected %lu\n",
+			nb_pages, reg->nb_pages);
+		if (nb_pages > 0)
+			dpu_rank_unpin_user_pages(reg->pages, nb_pages, false);
+		ret = -EFAULT;
+		goto free_pages;
+	}
+
+	mutex_lock(&rank->buffers_lock);
+	ret = idr_alloc(&rank->buffers, reg, 1, 0, GFP_KERNEL);
+	mutex_unlock(&rank->buffers_lock);
+	if (ret < 0)
+		goto unpin;
+
+	buffer.handle = ret;
+	if (copy_to_user((void *)ptr, &buffer, sizeof(buffer))) {
+		dpu_rank_unregister_buffer(rank, filp, buffer.handle);
+		return -EFAULT;
+	}
+
+	return 0;
+
+unpin:
+	dpu_rank_unpin_user_pages(reg->pages, reg->nb_pages, false);
+free_pages:
+	vfree(reg->pages);
+free_reg:
+	kfree(reg);
+	return ret;
+}
+
+int dpu_rank_unregister_buffer(struct dpu_rank_t *rank, struct file *filp,
+			       uint32_t handle)
+{
+	struct dpu_rank_buffer_reg *reg;
+
+	mutex_lock(&rank->buffers_lock);
+
+	reg = idr_find(&rank->buffers, handle);
+	if (!reg || reg->filp != filp) {
+		mutex_unlock(&rank->buffers_lock);
+		return -EINVAL;
+	}
+	idr_remove(&rank->buffers, handle);
+
+	mutex_unlock(&rank->buffers_lock);
+
+	dpu_rank_buffer_free(reg);
+
+	return 0;
+}
+
+/* Releases the buffers registered through filp, when it is closed */
+void dpu_rank_release_buffers(struct dpu_rank_t *rank, struct file *filp)
+{
+	struct dpu_rank_buffer_reg *reg;
+	int handle;
+
+	mutex_lock(&rank->buffers_lock);
+
+	idr_for_each_entry (&rank->buffers, reg, handle) {
+		if (reg->filp != filp)
+			continue;
+
+		idr_remove(&rank->buffers, handle);
+		dpu_rank_buffer_free(reg);
+	}
+
+	mutex_unlock(&rank->buffers_lock);
+}
+
+/* Points xferp at [offset, offset + size[ of a registered buffer */
+static int dpu_rank_buffer_get_slice(struct dpu_rank_t *rank,
+				     struct file *filp,
+				     struct dpu_rank_buffer_slice *slice,
+				     uint32_t size, struct xfer_page *xferp)
+{
+	struct dpu_rank_buffer_reg *reg;
+	uint64_t pos;
+
+	reg = idr_find(&rank->buffers, slice->handle);
+	if (!reg || reg->filp != filp)
+		return -EINVAL;
+
+	if (slice->offset > reg->size || size > reg->size - slice->offset)
+		return -EINVAL;
+
+	pos = reg->off_first_page + slice->offset;
+
+	xferp->pages = &reg->pages[pos >> PAGE_SHIFT];
+	xferp->off_first_page = pos & (PAGE_SIZE - 1);
+	xferp->nb_pages = DIV_ROUND_UP(xferp->off_first_page + size, PAGE_SIZE);
+
+	return 0;
+}
+
+int dpu_rank_xfer_registered(struct dpu_rank_t *rank, struct file *filp,
+			     unsigned long ptr, bool write)
+{
+	struct dpu_region_address_translation *tr;
+	struct dpu_transfer_mram_registered *xfer;
+	struct dpu_transfer_mram xfer_matrix;
+	uint8_t ci_id, dpu_id, nb_cis, nb_dpus_per_ci;
+	int idx, ret = 0;
+
+	tr = &rank->region->addr_translate;
+	nb_cis = tr->desc.topology.nr_of_control_interfaces;
+	nb_dpus_per_ci = tr->desc.topology.nr_of_dpus_per_control_interface;
+
+	xfer = kmalloc(sizeof(*xfer), GFP_KERNEL);
+	if (!xfer)
+		return -ENOMEM;
+
+	if (copy_from_user(xfer, (void *)ptr, sizeof(*xfer))) {
+		ret = -EFAULT;
+		goto free_xfer;
+	}
+
+	memset(&xfer_matrix, 0, sizeof(xfer_matrix));
+	xfer_matrix.offset_in_mram = xfer->offset_in_mram;
+	xfer_matrix.size = xfer->size;
+
+	/* Held during the transfer so that no buffer goes away under it */
+	mutex_lock(&rank->buffers_lock);
+
+	for_each_dpu_in_rank(idx, ci_id, dpu_id, nb_cis, nb_dpus_per_ci)
+	{
+		if (!xfer->slices[idx].handle)
+			continue;
+
+		ret = dpu_rank_buffer_get_slice(rank, filp, &xfer->slices[idx],
+						xfer->size, &rank->xfer_pg[idx]);
+		if (ret)
+			goto unlock;
+
+		xfer_matrix.ptr[idx] = &rank->xfer_pg[idx];
+	}
+
+	if (write)
+		tr->write_to_rank(tr, rank->region->base, rank->channel_id,
+				  &xfer_matrix);
+	else
+		tr->read_from_rank(tr, rank->region->base, rank->channel_id,
+				   &xfer_matrix);
+
+unlock:
+	mutex_unlock(&rank->buffers_lock);
+free_xfer:
+	kfree(xfer);
+
+	return ret;
+}
@@ -12,6 +12,86 @@
 
 #define DPU_RANK_IOCTL_MAGIC 'd'
 
+/* Host buffer registered with a rank fd, see DPU_RANK_IOCTL_REGISTER_BUFFER:
+ * the buffer must be writable, it is pinned until it is unregistered or the
+ * rank fd is closed.
+ */
+struct dpu_rank_buffer {
+	void *ptr;
+	uint64_t size;
+	/* Returned by the driver, never 0 */
+	uint32_t handle;
+};
+
+/* Part of a registered buffer, handle 0 means no transfer for this DPU */
+struct dpu_rank_buffer_slice {
+	uint32_t handle;
+	uint64_t offset;
+};
+
+/* Same as struct dpu_transfer_mram, with registered buffers */
+struct dpu_transfer_mram_registered {
+	struct dpu_rank_buffer_slice slices[MAX_NR_DPUS_PER_RANK];
+	uint32_t offset_in_mram;
+	uint32_t size;
+};
+
+/* Submission/completion ring of a rank fd, see DPU_RANK_IOCTL_SETUP_RING:
+ * the ring is mapped at offset DPU_RANK_RING_MMAP_OFFSET of the rank fd,
+ * with a struct dpu_rank_ring_header followed by the submission entries at
+ * sqes_offset and the completion entries at cqes_offset. Userspace owns
+ * sq_tail and cq_head, the driver owns sq_head and cq_tail.
+ */
+#define DPU_RANK_RING_MMAP_OFFSET 0x80000000ULL
+#define DPU_RANK_RING_MAX_ENTRIES 4096
+
+enum dpu_rank_ring_opcode {
+	/* addr points to a struct dpu_transfer_mram */
+	DPU_RANK_RING_OP_WRITE_TO_RANK,
+	DPU_RANK_RING_OP_READ_FROM_RANK,
+	/* addr points to a struct dpu_transfer_mram_registered */
+	DPU_RANK_RING_OP_WRITE_TO_RANK_REGISTERED,
+	DPU_RANK_RING_OP_READ_FROM_RANK_REGISTERED,
+	/* addr points to one uint64_t command per control interface */
+	DPU_RANK_RING_OP_COMMIT_COMMANDS,
+	DPU_RANK_RING_OP_UPDATE_COMMANDS,
+};
+
+struct dpu_rank_ring_params {
+	/* Rounded up to a power of 2 by the driver, cq_entries defaults to
+	 * twice sq_entries.
+	 */
+	uint32_t sq_entries;
+	uint32_t cq_entries;
+	/* Returned by the driver */
+	uint32_t sqes_offset;
+	uint32_t cqes_offset;
+	uint32_t size;
+};
+
+struct dpu_rank_ring_header {
+	uint32_t sq_head;
+	uint32_t sq_tail;
+	uint32_t sq_mask;
+	uint32_t cq_head;
+	uint32_t cq_tail;
+	uint32_t cq_mask;
+};
+
+struct dpu_rank_sqe {
+	uint64_t user_data;
+	uint64_t addr;
+	uint8_t opcode;
+	uint8_t reserved[7];
+};
+
+struct dpu_rank_cqe {
+	uint64_t user_data;
+	/* 0 or a negative errno, as returned by the matching ioctl */
+	int32_t res;
+	uint32_t reserved;
+};
+
 #define DPU_RANK_IOCTL_WRITE_TO_RANK                                           \
 	_IOW(DPU_RANK_IOCTL_MAGIC, 0, struct dpu_transfer_mram *)
 #define DPU_RANK_IOCTL_READ_FROM_RANK                                          \
@@ -19,5 +99,16 @@
 #define DPU_RANK_IOCTL_COMMIT_COMMANDS _IOW(DPU_RANK_IOCTL_MAGIC, 2, uint64_t *)
 #define DPU_RANK_IOCTL_UPDATE_COMMANDS _IOR(DPU_RANK_IOCTL_MAGIC, 3, uint64_t *)
 #define DPU_RANK_IOCTL_DEBUG_MODE _IOW(DPU_RANK_IOCTL_MAGIC, 4, uint8_t *)
+#define DPU_RANK_IOCTL_REGISTER_BUFFER                                         \
+	_IOWR(DPU_RANK_IOCTL_MAGIC, 5, struct dpu_rank_buffer *)
+#define DPU_RANK_IOCTL_UNREGISTER_BUFFER _IOW(DPU_RANK_IOCTL_MAGIC, 6, uint32_t)
+#define DPU_RANK_IOCTL_WRITE_TO_RANK_REGISTERED                                \
+	_IOW(DPU_RANK_IOCTL_MAGIC, 7, struct dpu_transfer_mram_registered *)
+#define DPU_RANK_IOCTL_READ_FROM_RANK_REGISTERED                               \
+	_IOW(DPU_RANK_IOCTL_MAGIC, 8, struct dpu_transfer_mram_registered *)
+#define DPU_RANK_IOCTL_SETUP_RING                                              \
+	_IOWR(DPU_RANK_IOCTL_MAGIC, 9, struct dpu_rank_ring_params *)
+#define DPU_RANK_IOCTL_RING_ENTER _IO(DPU_RANK_IOCTL_MAGIC, 10)
+#define DPU_RANK_IOCTL_RING_EVENTFD _IOW(DPU_RANK_IOCTL_MAGIC, 11, int)
 
 #endif /* DPU_RANK_IOCTL_INCLUDE_H */
@@ -0,0 +1,352 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Copyright 2020 UPMEM. All rights reserved. */
+#include <linux/kernel.h>
+#include <linux/eventfd.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+#include <linux/kthread.h>
+#else
+#include <linux/mmu_context.h>
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#include <linux/sched/mm.h>
+#else
+#include <linux/sched.h>
+#endif
+
+#include <dpu_rank.h>
+#include <dpu_rank_ioctl.h>
+#include <dpu_region.h>
+
+/*
+ * Submission/completion ring of a rank fd: userspace posts operations in
+ * the submission queue and kicks the ring with a single ioctl, a worker of
+ * the rank NUMA node runs them in order, in the address space of the
+ * process that set the ring up, and posts their results in the completion
+ * queue. Only that process may kick the ring. Completions wake up poll()
+ * and the optional eventfd.
+ */
+struct dpu_rank_ring {
+	struct dpu_rank_t *rank;
+	struct file *filp;
+	struct mm_struct *mm;
+
+	void *mem;
+	uint32_t size;
+	struct dpu_rank_ring_header *hdr;
+	struct dpu_rank_sqe *sqes;
+	struct dpu_rank_cqe *cqes;
+	uint32_t sq_entries;
+	uint32_t cq_entries;
+
+	/* Private copies of the indexes owned by the driver, the shared ones
+	 * can be overwritten by userspace.
+	 */
+	uint32_t sq_head;
+	uint32_t cq_tail;
+
+	struct work_struct work;
+	wait_queue_head_t wait;
+
+	spinlock_t eventfd_lock;
+	struct eventfd_ctx *eventfd;
+};
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 11, 0)
+static inline void mmgrab(struct mm_struct *mm)
+{
+	atomic_inc(&mm->mm_count);
+}
+
+static inline bool mmget_not_zero(struct mm_struct *mm)
+{
+	return atomic_inc_not_zero(&mm->mm_users);
+}
+#endif
+
+/* Returns the ring of rank if it was set up through filp */
+static struct dpu_rank_ring *dpu_rank_ring_get(struct dpu_rank_t *rank,
+					       struct file *filp)
+{
+	struct dpu_rank_ring *ring;
+
+	dpu_region_lock(rank->region);
+	ring = rank->ring;
+	if (ring && ring->filp != filp)
+		ring = NULL;
+	dpu_region_unlock(rank->region);
+
+	return ring;
+}
+
+static void dpu_rank_ring_signal(struct dpu_rank_ring *ring)
+{
+	wake_up_interruptible(&ring->wait);
+
+	spin_lock(&ring->eventfd_lock);
+	if (ring->eventfd)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+		eventfd_signal(ring->eventfd);
+#else
+		eventfd_signal(ring->eventfd, 1);
+#endif
+	spin_unlock(&ring->eventfd_lock);
+}
+
+static void dpu_rank_ring_work(struct work_struct *work)
+{
+	struct dpu_rank_ring *ring =
+		container_of(work, struct dpu_rank_ring, work);
+	struct dpu_rank_ring_header *hdr = ring->hdr;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 10, 0)
+	mm_segment_t old_fs;
+#endif
+	uint32_t sq_tail;
+
+	/* The process is exiting */
+	if (!mmget_not_zero(ring->mm))
+		return;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+	kthread_use_mm(ring->mm);
+#else
+	use_mm(ring->mm);
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 10, 0)
+	old_fs = get_fs();
+	set_fs(USER_DS);
+#endif
+
+	sq_tail = smp_load_acquire(&hdr->sq_tail);
+
+	while (ring->sq_head != sq_tail) {
+		struct dpu_rank_sqe sqe;
+		struct dpu_rank_cqe *cqe;
+
+		/* No room for the completion, wait for the next kick */
+		if (ring->cq_tail - smp_load_acquire(&hdr->cq_head) >=
+		    ring->cq_entries)
+			break;
+
+		memcpy(&sqe,
+		       &ring->sqes[ring->sq_head & (ring->sq_entries - 1)],
+		       sizeof(sqe));
+
+		cqe = &ring->cqes[ring->cq_tail & (ring->cq_entries - 1)];
+		cqe->user_data = sqe.user_data;
+		cqe->res = dpu_rank_ring_op(ring->rank, ring->filp,
+					    sqe.opcode, sqe.addr);
+		cqe->reserved = 0;
+
+		ring->sq_head++;
+		ring->cq_tail++;
+		smp_store_release(&hdr->sq_head, ring->sq_head);
+		smp_store_release(&hdr->cq_tail, ring->cq_tail);
+
+		dpu_rank_ring_signal(ring);
+
+		if (ring->sq_head == sq_tail)
+			sq_tail = smp_load_acquire(&hdr->sq_tail);
+
+		cond_resched();
+	}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 10, 0)
+	set_fs(old_fs);
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+	kthread_unuse_mm(ring->mm);
+#else
+	unuse_mm(ring->mm);
+#endif
+	mmput(ring->mm);
+}
+
+int dpu_rank_ring_setup(struct dpu_rank_t *rank, struct file *filp,
+			unsigned long ptr)
+{
+	struct dpu_rank_ring_params params;
+	struct dpu_rank_ring *ring;
+	uint32_t sqes_offset, cqes_offset;
+	int ret = 0;
+
+	if (copy_from_user(&params, (void *)ptr, sizeof(params)))
+		return -EFAULT;
+
+	if (!params.sq_entries || params.sq_entries > DPU_RANK_RING_MAX_ENTRIES)
+		return -EINVAL;
+	params.sq_entries = roundup_pow_of_two(params.sq_entries);
+
+	if (!params.cq_entries)
+		params.cq_entries = 2 * params.sq_entries;
+	if (params.cq_entries < params.sq_entries ||
+	    params.cq_entries > 2 * DPU_RANK_RING_MAX_ENTRIES)
+		return -EINVAL;
+	params.cq_entries = roundup_pow_of_two(params.cq_entries);
+
+	sqes_offset = ALIGN(sizeof(struct dpu_rank_ring_header),
+			    SMP_CACHE_BYTES);
+	cqes_offset = sqes_offset +
+		      params.sq_entries * sizeof(struct dpu_rank_sqe);
+	params.sqes_offset = sqes_offset;
+	params.cqes_offset = cqes_offset;
+	params.size = PAGE_ALIGN(cqes_offset + params.cq_entries *
+				 sizeof(struct dpu_rank_cqe));
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+
+	ring->mem = vmalloc_user(params.size);
+	if (!ring->mem) {
+		ret = -ENOMEM;
+		goto free_ring;
+	}
+
+	ring->rank = rank;
+	ring->filp = filp;
+	ring->size = params.size;
+	ring->hdr = ring->mem;
+	ring->sqes = ring->mem + sqes_offset;
+	ring->cqes = ring->mem + cqes_offset;
+	ring->sq_entries = params.sq_entries;
+	ring->cq_entries = params.cq_entries;
+	ring->hdr->sq_mask = params.sq_entries - 1;
+	ring->hdr->cq_mask = params.cq_entries - 1;
+	INIT_WORK(&ring->work, dpu_rank_ring_work);
+	init_waitqueue_head(&ring->wait);
+	spin_lock_init(&ring->eventfd_lock);
+
+	if (copy_to_user((void *)ptr, &params, sizeof(params))) {
+		ret = -EFAULT;
+		goto free_mem;
+	}
+
+	dpu_region_lock(rank->region);
+	if (rank->ring) {
+		dpu_region_unlock(rank->region);
+		ret = -EBUSY;
+		goto free_mem;
+	}
+	ring->mm = current->mm;
+	mmgrab(ring->mm);
+	rank->ring = ring;
+	dpu_region_unlock(rank->region);
+
+	return 0;
+
+free_mem:
+	vfree(ring->mem);
+free_ring:
+	kfree(ring);
+	return ret;
+}
+
+int dpu_rank_ring_enter(struct dpu_rank_t *rank, struct file *filp)
+{
+	struct dpu_rank_ring *ring = dpu_rank_ring_get(rank, filp);
+
+	if (!ring)
+		return -EINVAL;
+
+	/* The addresses of the submissions belong to the mm of the ring, a
+	 * child or a process the fd was passed to must set up its own ring.
+	 */
+	if (current->mm != ring->mm)
+		return -EPERM;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+	queue_work_node(rank->nid, system_unbound_wq, &ring->work);
+#else
+	queue_work(system_unbound_wq, &ring->work);
+#endif
+
+	return 0;
+}
+
+/* A negative fd detaches the current eventfd */
+int dpu_rank_ring_set_eventfd(struct dpu_rank_t *rank, struct file *filp,
+			      int fd)
+{
+	struct dpu_rank_ring *ring = dpu_rank_ring_get(rank, filp);
+	struct eventfd_ctx *eventfd = NULL, *old;
+
+	if (!ring)
+		return -EINVAL;
+
+	if (fd >= 0) {
+		eventfd = eventfd_ctx_fdget(fd);
+		if (IS_ERR(eventfd))
+			return PTR_ERR(eventfd);
+	}
+
+	spin_lock(&ring->eventfd_lock);
+	old = ring->eventfd;
+	ring->eventfd = eventfd;
+	spin_unlock(&ring->eventfd_lock);
+
+	if (old)
+		eventfd_ctx_put(old);
+
+	return 0;
+}
+
+int dpu_rank_ring_mmap(struct dpu_rank_t *rank, struct file *filp,
+		       struct vm_area_struct *vma)
+{
+	struct dpu_rank_ring *ring = dpu_rank_ring_get(rank, filp);
+
+	if (!ring)
+		return -EINVAL;
+
+	if (vma->vm_end - vma->vm_start > ring->size)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, ring->mem, 0);
+}
+
+unsigned int dpu_rank_ring_poll(struct dpu_rank_t *rank, struct file *filp,
+				poll_table *wait)
+{
+	struct dpu_rank_ring *ring = dpu_rank_ring_get(rank, filp);
+
+	if (!ring)
+		return POLLERR;
+
+	poll_wait(filp, &ring->wait, wait);
+
+	if (READ_ONCE(ring->hdr->cq_head) != READ_ONCE(ring->cq_tail))
+		return POLLIN | POLLRDNORM;
+
+	return 0;
+}
+
+/* Pending submissions are dropped when the rank fd is closed */
+void dpu_rank_ring_release(struct dpu_rank_t *rank, struct file *filp)
+{
+	struct dpu_rank_ring *ring;
+
+	dpu_region_lock(rank->region);
+	ring = rank->ring;
+	if (!ring || ring->filp != filp) {
+		dpu_region_unlock(rank->region);
+		return;
+	}
+	rank->ring = NULL;
+	dpu_region_unlock(rank->region);
+
+	cancel_work_sync(&ring->work);
+
+	if (ring->eventfd)
+		eventfd_ctx_put(ring->eventfd);
+	mmdrop(ring->mm);
+	vfree(ring->mem);
+	kfree(ring);
+}
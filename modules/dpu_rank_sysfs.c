@@ -266,6 +266,96 @@ static ssize_t debug_mode_store(struct device *dev,
 	return len;
 }
 
+static ssize_t write_mode_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct dpu_rank_t *rank = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%hhu\n", rank->write_mode);
+}
+
+static ssize_t write_mode_store(struct device *dev,
+				struct device_attribute *attr, const char *buf,
+				size_t len)
+{
+	struct dpu_rank_t *rank = dev_get_drvdata(dev);
+	struct dpu_region *region = rank->region;
+	int ret;
+	uint8_t tmp;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	ret = kstrtou8(buf, 10, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp != DPU_RANK_WRITE_MODE_FLUSH &&
+	    tmp != DPU_RANK_WRITE_MODE_STREAM) {
+		dev_err(dev, "write_mode: value %u is undefined\n", tmp);
+		return -EINVAL;
+	}
+
+	if (tmp == DPU_RANK_WRITE_MODE_STREAM &&
+	    !(region->addr_translate.capabilities & CAP_STREAM_WRITE)) {
+		dev_err(dev, "write_mode: backend does not support streaming\n");
+		return -EINVAL;
+	}
+
+	dpu_region_lock(region);
+
+	WRITE_ONCE(rank->write_mode, tmp);
+
+	dpu_region_unlock(region);
+
+	return len;
+}
+
+static ssize_t xfer_workers_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct dpu_rank_t *rank = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%hhu\n", rank->xfer_workers);
+}
+
+static ssize_t xfer_workers_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t len)
+{
+	struct dpu_rank_t *rank = dev_get_drvdata(dev);
+	struct dpu_region *region = rank->region;
+	int ret;
+	uint8_t tmp;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	ret = kstrtou8(buf, 10, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp > DPU_RANK_MAX_XFER_WORKERS) {
+		dev_err(dev, "xfer_workers: at most %u workers\n",
+			DPU_RANK_MAX_XFER_WORKERS);
+		return -EINVAL;
+	}
+
+	if (tmp && !(region->addr_translate.capabilities & CAP_PARALLEL_XFER)) {
+		dev_err(dev,
+			"xfer_workers: backend does not support parallel transfers\n");
+		return -EINVAL;
+	}
+
+	dpu_region_lock(region);
+
+	WRITE_ONCE(rank->xfer_workers, tmp);
+
+	dpu_region_unlock(region);
+
+	return len;
+}
+
 static ssize_t rank_id_show(struct device *dev, struct device_attribute *attr,
 			    char *buf)
 {
@@ -384,6 +474,8 @@ static DEVICE_ATTR_RO(dpu_chip_id);
 static DEVICE_ATTR_RO(backend_id);
 static DEVICE_ATTR_RW(mode);
 static DEVICE_ATTR_RW(debug_mode);
+static DEVICE_ATTR_RW(write_mode);
+static DEVICE_ATTR_RW(xfer_workers);
 static DEVICE_ATTR_RO(rank_id);
 static DEVICE_ATTR_RO(capabilities);
 static DEVICE_ATTR_RO(byte_order);
@@ -401,7 +493,8 @@ static struct attribute *dpu_rank_attrs[] = {
 	&dev_attr_dpu_chip_id.attr,    &dev_attr_backend_id.attr,
 	&dev_attr_mode.attr,	       &dev_attr_debug_mode.attr,
 	&dev_attr_rank_id.attr,	       &dev_attr_capabilities.attr,
-	&dev_attr_byte_order.attr,     NULL,
+	&dev_attr_byte_order.attr,     &dev_attr_write_mode.attr,
+	&dev_attr_xfer_workers.attr,   NULL,
 };
 
 static struct bin_attribute *dpu_rank_bin_attrs[] = {
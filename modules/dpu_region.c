@@ -557,6 +557,10 @@ static int __init dpu_region_init(void)
     if (membo_initialized)
         dpu_membo_class->dev_uevent = dpu_membo_dev_uevent;
 
+#ifdef CONFIG_X86_64
+	xeon_sp_translation_init();
+#endif
+
 	pr_debug("dpu: get rank information from DMI\n");
 	dpu_rank_dmi_init();
 
@@ -612,6 +616,9 @@ kc705_error:
 	platform_driver_unregister(&dpu_region_mem_driver);
 mem_error:
 	dpu_rank_dmi_exit();
+#ifdef CONFIG_X86_64
+	xeon_sp_translation_exit();
+#endif
 	class_destroy(dpu_dax_class);
 	class_destroy(dpu_rank_class);
 	class_destroy(dpu_membo_class);
@@ -632,6 +639,10 @@ static void __exit dpu_region_exit(void)
 	class_destroy(dpu_rank_class);
 	ida_destroy(&dpu_region_ida);
 
+#ifdef CONFIG_X86_64
+	xeon_sp_translation_exit();
+#endif
+
     dpu_membo_release_device();
 	class_destroy(dpu_membo_class);
     for_each_online_node(node)
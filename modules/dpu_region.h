@@ -73,10 +73,20 @@ struct dpu_region {
 		uint8_t channel_id;
         int nid;
         atomic_t nr_ltb_sections;
-        bool is_reserved;
+        /* Lent sections, and their heat estimate (see membo_heat_work_fn) */
+        DECLARE_BITMAP(ltb_sections, SECTIONS_PER_DPU_RANK);
+        uint8_t ltb_heat[SECTIONS_PER_DPU_RANK];
+        /* When each lent section was lent, in jiffies */
+        unsigned long ltb_jiffies[SECTIONS_PER_DPU_RANK];
+        /* enum membo_rank_state, and the matching membo_context list */
+        uint8_t membo_state;
+        struct list_head state_list;
 		uint8_t slot_index;
 
 		uint8_t debug_mode;
+		uint8_t write_mode;
+		/* Node-local workers for rank transfers, 0: caller CPU */
+		uint8_t xfer_workers;
 
 		uint64_t control_interface[DPU_MAX_NR_CIS];
 		uint64_t data[DPU_MAX_NR_CIS];
@@ -87,6 +97,19 @@ struct dpu_region {
 		struct page **xfer_dpu_page_array;
 		struct xfer_page xfer_pg[DPU_MAX_NR_DPUS];
 
+		/* Host buffers registered for transfers, by handle */
+		struct idr buffers;
+		struct mutex buffers_lock;
+
+		/* Serializes the transfers and commands of the ioctls, of the
+		 * ring worker and of the batched transfers: they share xfer_pg
+		 * and the control interface.
+		 */
+		struct mutex xfer_lock;
+
+		/* Submission/completion ring, protected by the region lock */
+		struct dpu_rank_ring *ring;
+
 		/* Information requested from the MCU */
 		uint8_t rank_index;
 		uint8_t rank_count;
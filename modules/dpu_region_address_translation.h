@@ -16,6 +16,8 @@
 
 #ifdef CONFIG_X86_64
 extern struct dpu_region_address_translation xeon_sp_translate;
+void xeon_sp_translation_init(void);
+void xeon_sp_translation_exit(void);
 #endif
 extern struct dpu_region_address_translation fpga_kc705_translate_1dpu;
 extern struct dpu_region_address_translation fpga_kc705_translate_8dpu;
@@ -39,6 +41,8 @@ enum backend {
 #define CAP_HYBRID_CONTROL_INTERFACE (1 << 2)
 #define CAP_HYBRID_MRAM (1 << 3)
 #define CAP_HYBRID (CAP_HYBRID_MRAM | CAP_HYBRID_CONTROL_INTERFACE)
+#define CAP_STREAM_WRITE (1 << 4)
+#define CAP_PARALLEL_XFER (1 << 5)
 
 #ifndef MAX_NR_DPUS_PER_RANK
 #define MAX_NR_DPUS_PER_RANK 64
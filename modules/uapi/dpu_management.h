@@ -7,7 +7,12 @@
 
 #include "dpu.h"
 
+/* Take a rank on a channel, or else a DIMM, that none of allocated uses */
+#define DPU_RANK_ALLOC_SPREAD (1 << 0)
+
 uint32_t dpu_rank_alloc(struct dpu_rank_t **rank);
+uint32_t dpu_rank_alloc_hint(struct dpu_rank_t **rank, uint32_t hint,
+			    struct dpu_rank_t **allocated, uint32_t nr_allocated);
 uint32_t dpu_rank_free(struct dpu_rank_t *rank);
 uint32_t dpu_get_number_of_available_ranks(void);
 uint32_t dpu_get_number_of_dpus_for_rank(struct dpu_rank_t *rank);